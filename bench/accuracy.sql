@@ -0,0 +1,24 @@
+-- Accuracy report - compare sketch estimates to exact counts for a set
+-- of deterministic predicates, for each accuracy point.
+WITH preds AS (
+    SELECT mod(i, 100) AS a, mod(i, 1000) AS b
+      FROM generate_series(1, 100) s(i)
+),
+exact AS (
+    SELECT p.a, p.b, count(d.id) AS cnt
+      FROM preds p LEFT JOIN bench_data d ON (d.a = p.a AND d.b = p.b)
+     GROUP BY p.a, p.b
+),
+sketches AS (
+    SELECT eps, delta, omnisketch(s) AS s
+      FROM bench_sketches WHERE ncols = 2
+     GROUP BY eps, delta
+)
+SELECT s.eps, s.delta,
+       round(avg(abs(omnisketch_estimate(s.s, row(e.a, e.b)) - e.cnt)), 2) AS avg_abs_error,
+       max(abs(omnisketch_estimate(s.s, row(e.a, e.b)) - e.cnt)) AS max_abs_error,
+       round(avg(abs(omnisketch_estimate(s.s, row(e.a, e.b)) - e.cnt)
+                 / greatest(e.cnt, 1))::numeric, 4) AS avg_rel_error
+  FROM sketches s, exact e
+ GROUP BY s.eps, s.delta
+ ORDER BY s.eps, s.delta;
@@ -0,0 +1,5 @@
+-- Combine throughput - each transaction merges the 16 partitions of one
+-- sketch set, so sketches/s = tps * 16. Exercises omnisketch_combine and
+-- omnisketch_merge_buckets.
+SELECT omnisketch(s) FROM bench_sketches
+ WHERE eps = 0.01 AND delta = 0.01 AND ncols = 2;
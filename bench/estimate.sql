@@ -0,0 +1,8 @@
+-- Estimate latency - combine the partitions and estimate a random
+-- predicate. Exercises the estimate path (intersect_items etc.) on top
+-- of the combine.
+\set a random(0, 99)
+\set b random(0, 999)
+SELECT omnisketch_estimate(omnisketch(s), (:a, :b))
+  FROM bench_sketches
+ WHERE eps = 0.01 AND delta = 0.01 AND ncols = 2;
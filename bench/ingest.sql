@@ -0,0 +1,4 @@
+-- Ingest throughput - each transaction aggregates 100k rows into a new
+-- sketch, so rows/s = tps * 100000. Exercises omnisketch_add and
+-- omnisketch_add_hash.
+SELECT omnisketch(0.01, 0.01, (a, b)) FROM bench_data WHERE id <= 100000;
@@ -0,0 +1,29 @@
+-- Initialize the benchmark database. Expects a "scale" variable (set by
+-- run.sh), with scale 1 meaning 100k rows of the base data set.
+
+-- deterministic data set - three attributes with different cardinalities
+CREATE TABLE bench_data (id int, a int, b int, c int);
+
+INSERT INTO bench_data
+SELECT i, mod(i,100), mod(i,1000), mod(i,10000)
+  FROM generate_series(1, :scale * 100000) s(i);
+
+ANALYZE bench_data;
+
+-- Precomputed sketches at several (epsilon, delta, ncolumns) points,
+-- partitioned 16 ways so that combine/estimate have something to merge.
+CREATE TABLE bench_sketches (eps float8, delta float8, ncols int, part int, s omnisketch);
+
+INSERT INTO bench_sketches
+SELECT eps, delta, 2, mod(id, 16), omnisketch(eps, delta, (a, b))
+  FROM bench_data,
+       (VALUES (0.05, 0.05), (0.01, 0.01), (0.005, 0.01)) p(eps, delta)
+ GROUP BY eps, delta, mod(id, 16);
+
+INSERT INTO bench_sketches
+SELECT eps, delta, 3, mod(id, 16), omnisketch(eps, delta, (a, b, c))
+  FROM bench_data,
+       (VALUES (0.05, 0.05), (0.01, 0.01)) p(eps, delta)
+ GROUP BY eps, delta, mod(id, 16);
+
+ANALYZE bench_sketches;
@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Benchmark driver for the omnisketch extension - measures ingest and
+# combine throughput and estimate latency with pgbench, and prints an
+# accuracy report (estimates vs. exact counts). Meant for comparing
+# builds, not for absolute numbers.
+#
+# Requires a running cluster with the extension installed (make install),
+# reachable through the usual PG* environment variables / defaults.
+# Tunables:
+#
+#   BENCH_DB       database to (re)create [bench_omnisketch]
+#   BENCH_SCALE    data set size, in units of 100k rows [1]
+#   BENCH_TIME     pgbench duration per workload, in seconds [10]
+#   BENCH_CLIENTS  pgbench clients/jobs [4]
+
+set -e
+
+BENCH_DB=${BENCH_DB:-bench_omnisketch}
+BENCH_SCALE=${BENCH_SCALE:-1}
+BENCH_TIME=${BENCH_TIME:-10}
+BENCH_CLIENTS=${BENCH_CLIENTS:-4}
+
+cd "$(dirname "$0")"
+
+dropdb --if-exists "$BENCH_DB"
+createdb "$BENCH_DB"
+
+psql -q "$BENCH_DB" -c "CREATE EXTENSION omnisketch"
+psql -q "$BENCH_DB" -v scale="$BENCH_SCALE" -f init.sql
+
+# latency percentiles from the per-transaction pgbench logs (the latency
+# is the third column, in microseconds)
+percentiles() {
+	cat pgbench_log.* | sort -n -k 3 | awk '
+		{ lat[NR] = $3 }
+		END {
+			if (NR == 0) exit
+			printf "latency percentiles: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms\n",
+				   lat[int(NR * 0.50) + 1] / 1000.0,
+				   lat[int(NR * 0.90) + 1] / 1000.0,
+				   lat[int(NR * 0.99) + 1] / 1000.0
+		}'
+}
+
+run() {
+	echo "=== $1 ==="
+	rm -f pgbench_log.*
+	pgbench -n -f "$1.sql" -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" \
+			-T "$BENCH_TIME" -l --log-prefix=pgbench_log "$BENCH_DB" \
+		| grep -E 'tps|latency'
+	percentiles
+	rm -f pgbench_log.*
+}
+
+run ingest
+run combine
+run estimate
+
+echo "=== accuracy ==="
+psql "$BENCH_DB" -f accuracy.sql
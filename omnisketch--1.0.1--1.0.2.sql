@@ -0,0 +1,189 @@
+CREATE OR REPLACE FUNCTION omnisketch_add_batch(omnisketch, double precision, double precision, anyarray)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_add_batch'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE omnisketch(double precision, double precision, anyarray) (
+    SFUNC = omnisketch_add_batch,
+    STYPE = omnisketch,
+    FINALFUNC = omnisketch_finalize,
+    COMBINEFUNC = omnisketch_combine,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION omnisketch_add_budget(omnisketch, double precision, double precision, bigint, record)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_add_budget'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE omnisketch(double precision, double precision, bigint, record) (
+    SFUNC = omnisketch_add_budget,
+    STYPE = omnisketch,
+    FINALFUNC = omnisketch_finalize,
+    COMBINEFUNC = omnisketch_combine,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION omnisketch_add_range(omnisketch, double precision, double precision, int, record)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_add_range'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE omnisketch_range(double precision, double precision, int, record) (
+    SFUNC = omnisketch_add_range,
+    STYPE = omnisketch,
+    FINALFUNC = omnisketch_finalize,
+    COMBINEFUNC = omnisketch_combine,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION omnisketch_estimate_range(omnisketch, int, int)
+    RETURNS bigint
+    AS 'omnisketch', 'omnisketch_estimate_range'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION omnisketch_estimate_range(omnisketch, int, int, record)
+    RETURNS bigint
+    AS 'omnisketch', 'omnisketch_estimate_range'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION omnisketch_pack(omnisketch)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_pack'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION omnisketch_unpack(omnisketch)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_unpack'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Mark all the support functions as parallel safe. The aggregates already
+-- are (and with a plain varlena transition type they don't need explicit
+-- serialization functions), but the functions themselves defaulted to
+-- PARALLEL UNSAFE, preventing e.g. omnisketch_estimate calls in plans
+-- using parallel workers.
+ALTER FUNCTION omnisketch_in(cstring) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_out(omnisketch) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_send(omnisketch) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_recv(internal) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_add(omnisketch, double precision, double precision, record) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_combine(omnisketch, omnisketch) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_finalize(omnisketch) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_count(omnisketch) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_estimate(omnisketch, record) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_text(omnisketch) PARALLEL SAFE;
+ALTER FUNCTION omnisketch_json(omnisketch) PARALLEL SAFE;
+
+-- estimate many predicates against the same sketch in one call
+CREATE OR REPLACE FUNCTION omnisketch_estimate_batch(omnisketch, anyarray)
+    RETURNS bigint[]
+    AS 'omnisketch', 'omnisketch_estimate_batch'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- summary statistics (one row per attribute sub-sketch)
+CREATE OR REPLACE FUNCTION omnisketch_stats(
+    omnisketch,
+    OUT sketch int,
+    OUT buckets int,
+    OUT nonempty double precision,
+    OUT fill_factor double precision,
+    OUT saturated double precision,
+    OUT min_count bigint,
+    OUT max_count bigint,
+    OUT avg_count double precision)
+    RETURNS SETOF record
+    AS 'omnisketch', 'omnisketch_stats'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- sketch with 64-bit counters (for streams beyond ~4B records)
+CREATE OR REPLACE FUNCTION omnisketch_add_wide(omnisketch, double precision, double precision, record)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_add_wide'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE omnisketch_wide(double precision, double precision, record) (
+    SFUNC = omnisketch_add_wide,
+    STYPE = omnisketch,
+    FINALFUNC = omnisketch_finalize,
+    COMBINEFUNC = omnisketch_combine,
+    PARALLEL = SAFE
+);
+
+-- sliding-window sketch (a ring of per-epoch sub-sketches in one value)
+CREATE OR REPLACE FUNCTION omnisketch_add_window(omnisketch, double precision, double precision, int, int, record)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_add_window'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE omnisketch_window(double precision, double precision, int, int, record) (
+    SFUNC = omnisketch_add_window,
+    STYPE = omnisketch,
+    FINALFUNC = omnisketch_finalize,
+    COMBINEFUNC = omnisketch_combine,
+    PARALLEL = SAFE
+);
+
+-- retire the epochs that fell out of the window of a stored sketch
+CREATE OR REPLACE FUNCTION omnisketch_advance(omnisketch, int)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_advance'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Rebuild the omnisketch(sketch) rollup on a state that collects the input
+-- sketches and merges them in batches, with a single k-way heap merge per
+-- bucket instead of one pairwise bucket merge per input sketch.
+CREATE OR REPLACE FUNCTION omnisketch_merge_accum(internal, omnisketch)
+    RETURNS internal
+    AS 'omnisketch', 'omnisketch_merge_accum'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION omnisketch_merge_combine(internal, internal)
+    RETURNS internal
+    AS 'omnisketch', 'omnisketch_merge_combine'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION omnisketch_merge_serial(internal)
+    RETURNS bytea
+    AS 'omnisketch', 'omnisketch_merge_serial'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION omnisketch_merge_deserial(bytea, internal)
+    RETURNS internal
+    AS 'omnisketch', 'omnisketch_merge_deserial'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION omnisketch_merge_final(internal)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_merge_final'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE omnisketch(omnisketch);
+
+CREATE AGGREGATE omnisketch(omnisketch) (
+    SFUNC = omnisketch_merge_accum,
+    STYPE = internal,
+    FINALFUNC = omnisketch_merge_final,
+    COMBINEFUNC = omnisketch_merge_combine,
+    SERIALFUNC = omnisketch_merge_serial,
+    DESERIALFUNC = omnisketch_merge_deserial,
+    PARALLEL = SAFE
+);
+
+-- fold a single record into a stored sketch (no aggregate, no combine)
+CREATE OR REPLACE FUNCTION omnisketch_add_record(omnisketch, record)
+    RETURNS omnisketch
+    AS 'omnisketch', 'omnisketch_add_record'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- structured dump of the sketch contents (one row per bucket)
+CREATE OR REPLACE FUNCTION omnisketch_buckets(
+    omnisketch,
+    OUT sketch int,
+    OUT i int,
+    OUT j int,
+    OUT total bigint,
+    OUT sample int,
+    OUT items int[])
+    RETURNS SETOF record
+    AS 'omnisketch', 'omnisketch_buckets'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
@@ -12,15 +12,44 @@
 #include <math.h>
 #include <xxh3.h>
 
+/*
+ * On x86-64 we use SIMD (SSE2 as the baseline, AVX2 when the CPU supports
+ * it) to speed up the sample intersection. Everywhere else we fall back to
+ * plain scalar code.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define OMNISKETCH_SIMD_X86
+#endif
+
+/*
+ * Software prefetch hints for the random accesses in the hot loops (a
+ * no-op on compilers without the builtin). The second argument is the
+ * read/write intent.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define omnisketch_prefetch(ptr)		__builtin_prefetch((ptr), 0)
+#define omnisketch_prefetch_write(ptr)	__builtin_prefetch((ptr), 1)
+#else
+#define omnisketch_prefetch(ptr)		((void) 0)
+#define omnisketch_prefetch_write(ptr)	((void) 0)
+#endif
+
 #include "postgres.h"
 #include "catalog/pg_type.h"
 #include "common/hashfn.h"
+#include "port/pg_bitutils.h"
 #if (PG_VERSION_NUM >= 150000)
 #include "common/pg_prng.h"
 #endif
 #include "funcapi.h"
+#include "libpq/pqformat.h"
 #include "miscadmin.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/expandeddatum.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/typcache.h"
 
 PG_MODULE_MAGIC;
@@ -29,7 +58,7 @@ PG_MODULE_MAGIC;
 typedef struct omnisketch_t
 {
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
-	int32		flags;			/* reserved for future use (versioning, ...) */
+	int32		flags;			/* optional features (OMNISKETCH_FLAG_*) */
 	int16		numSketches;	/* number of per-attribute sketches */
 	int16		sketchWidth;	/* number of "columns" of sketches */
 	int16		sketchHeight;	/* number of "rows" of sketches */
@@ -41,21 +70,116 @@ typedef struct omnisketch_t
 	/* followed by data (counts/samples) for each sketch */
 } omnisketch_t;
 
-/* single bucket of a sketch */
+/*
+ * Single bucket of a sketch (the working representation). The counter is
+ * 64-bit so the same code handles both the regular and the wide-counter
+ * sketches (see OMNISKETCH_FLAG_WIDE_COUNTS) - the stored width depends
+ * on the sketch and is handled by sketch_bucket_load / sketch_bucket_store.
+ */
 typedef struct bucket_t
 {
-	uint32		totalCount;		/* total entries represented by bucket */
+	uint64		totalCount;		/* total entries represented by bucket */
 	uint16		sampleCount;	/* number of entries in the sample */
 	uint16		maxIndex;		/* index on the entry with the max hash */
 	uint32		maxHash;		/* maximum hash */
 	bool		isSorted;		/* is bucket sample sorted (by hash) */
 } bucket_t;
 
-/* array of item IDs (not necessarily ordered) */
+/*
+ * On-disk bucket layout of sketches without OMNISKETCH_FLAG_SOA (built by
+ * older versions). Must not change - it's part of the stored format.
+ */
+typedef struct bucket_disk_t
+{
+	uint32		totalCount;		/* total entries represented by bucket */
+	uint16		sampleCount;	/* number of entries in the sample */
+	uint16		maxIndex;		/* index on the entry with the max hash */
+	uint32		maxHash;		/* maximum hash */
+	bool		isSorted;		/* is bucket sample sorted (by hash) */
+} bucket_disk_t;
+
+/*
+ * Sample chunk of one bucket of the sparse transition state - the stored
+ * item hashes, followed by the items themselves (in SKETCH_ITEM_BYTES each,
+ * like in the flat sketch). Chunks grow geometrically as items arrive, up
+ * to the sampleSize of the sketch.
+ */
+typedef struct omnisketch_chunk_t
+{
+	uint32		capacity;		/* allocated sample slots */
+	uint32		hashes[FLEXIBLE_ARRAY_MEMBER];	/* capacity hashes, then items */
+} omnisketch_chunk_t;
+
+#define CHUNK_HASHES(c)		((c)->hashes)
+#define CHUNK_ITEMS(c)		((char *) &(c)->hashes[(c)->capacity])
+
+#define CHUNK_INITIAL_SIZE	8
+
+/*
+ * Sparse representation of the sketch, used as the aggregate transition
+ * state while the aggregate runs. The flat sketch reserves the full sample
+ * arrays up front - with many groups (e.g. a GROUP BY with tens of
+ * thousands of partitions) that front-loads a lot of memory that mostly
+ * holds zeroes. The sparse state keeps the dense counter arrays (they are
+ * small), but allocates the per-bucket samples lazily, in chunks that grow
+ * with the data - so small groups cost kilobytes, not megabytes. The state
+ * is flattened into the regular dense layout when the aggregate machinery
+ * asks for the flat value (finalize, serialization), or when combining.
+ *
+ * The embedded header is laid out exactly like the flat sketch header,
+ * including the 64-bit record count right after the struct (the static
+ * assert below), so the code generating IDs and picking buckets works on
+ * either form.
+ */
+typedef struct omnisketch_sparse_t
+{
+	omnisketch_t hdr;			/* same header as the flat sketch */
+	int64		count64;		/* record count (SKETCH_COUNT64 of the hdr) */
+
+	MemoryContext cxt;			/* context the chunks are allocated in */
+
+	/* dense per-bucket counters (indexed by SKETCH_BUCKET_INDEX) */
+	uint64	   *totalCounts;
+	uint16	   *sampleCounts;
+
+	/* per-bucket sample chunks, allocated on first use (NULL until then) */
+	omnisketch_chunk_t **chunks;
+} omnisketch_sparse_t;
+
+StaticAssertDecl(offsetof(omnisketch_sparse_t, count64) == MAXALIGN(sizeof(omnisketch_t)),
+				 "count64 must be where SKETCH_COUNT64 expects it");
+
+/*
+ * Expanded (in-memory) representation of the sketch, used as the aggregate
+ * transition state. New sketches start in the sparse representation (see
+ * omnisketch_sparse_t) and get flattened on demand; a sketch expanded from
+ * an existing flat value is kept flat, with all updates happening in place.
+ * Either way the aggregate machinery does not need to copy the (possibly
+ * multi-megabyte) sketch between the transition calls - it's flattened
+ * only once, at the end.
+ */
+typedef struct omnisketch_expanded_t
+{
+	ExpandedObjectHeader hdr;
+
+	/* distinguishes the expanded omnisketch from other expanded objects */
+	int32		magic;
+
+	/* the sketch (allocated in hdr.eoh_context), may be NULL initially */
+	omnisketch_t *sketch;
+
+	/* the sparse state (also in hdr.eoh_context), NULL once flattened */
+	omnisketch_sparse_t *sparse;
+} omnisketch_expanded_t;
+
+#define OMNISKETCH_MAGIC	0x6f6d6e69	/* ID for debugging crosschecks */
+
+/* array of item IDs and their hashes (not necessarily ordered) */
 typedef struct item_list_t
 {
 	uint32		nitems;
-	int32		items[FLEXIBLE_ARRAY_MEMBER];
+	int32	   *items;
+	uint32	   *hashes;
 } item_list_t;
 
 /* item and a hash of the item */
@@ -64,36 +188,239 @@ typedef struct item_hash_t {
 	uint32		hash;
 } item_hash_t;
 
+/*
+ * The sketch stores the hashes of the sampled items along with the item
+ * IDs (in a parallel array addressed like the samples), so the hot paths
+ * (add, merge, intersect) never need to recompute a hash. Sketches built
+ * by older versions lack the array, so all the code paths need to handle
+ * both layouts - with the flag unset, hashes are computed on the fly.
+ */
+#define OMNISKETCH_FLAG_HASHES		0x0001
+
+/*
+ * The sketch width is a power of two, so the bucket lookup can use a cheap
+ * bitwise mask instead of a modulo by a runtime-variable divisor. Set for
+ * all new sketches (the width is rounded up, which only improves accuracy);
+ * older sketches may have an arbitrary width and use the modulo.
+ */
+#define OMNISKETCH_FLAG_POW2_WIDTH	0x0002
+
+/*
+ * Packed (compressed) serialized format. The regular layout allocates the
+ * full sampleSize for every sample and a parallel array of item hashes,
+ * most of which is zeroes / redundant on disk. The packed format stores
+ * each bucket as varint-encoded counters followed by just the sampled
+ * items (sorted by hash), with the hashes recomputed when unpacking. The
+ * in-memory code never operates on a packed sketch - it's expanded when
+ * detoasting the value.
+ */
+#define OMNISKETCH_FLAG_PACKED		0x0004
+
+/*
+ * The sampled items are stored using just enough bytes for itemSize bits
+ * (the "b" computed when sizing the sketch), instead of a full 4-byte
+ * integer. The item IDs only need itemSize bits to stay unique with high
+ * probability, and the samples are the bulk of the sketch, so e.g. with
+ * the typical b ~ 24 this shaves a quarter off the sample arrays. This
+ * requires the generated IDs to be masked to itemSize bits - sketches
+ * built by older versions use the full 32 bits, so they can't be
+ * narrowed retroactively and keep using 32-bit items.
+ */
+#define OMNISKETCH_FLAG_NARROW_ITEMS	0x0008
+
+/*
+ * Bucket metadata stored as separate dense arrays (structure of arrays) -
+ * a totalCount[] and a sampleCount[] addressed by SKETCH_BUCKET_INDEX -
+ * instead of the array of 16-byte bucket_t structs. The estimate path
+ * only reads the two counters of each probed bucket, so with this layout
+ * the d random probes touch dense, prefetchable arrays instead of
+ * dragging whole structs (plus padding) through the cache. The remaining
+ * bucket_t fields are derivable for sketches with stored hashes - the
+ * samples are kept permanently sorted, so the maximum hash is simply the
+ * last stored hash. All bucket accesses go through sketch_bucket_load /
+ * sketch_bucket_store, which handle both layouts.
+ */
+#define OMNISKETCH_FLAG_SOA			0x0010
+
+/*
+ * 64-bit counters - both the per-bucket totals and the record count. The
+ * regular 32-bit counters silently wrap after ~4B records, which makes the
+ * estimates garbage, so long-lived sketches on high-velocity streams need
+ * the wide variant (see the omnisketch_wide aggregate). The record count
+ * doesn't fit the int32 header field, so it's stored right after the
+ * header struct (SKETCH_COUNT64), and the dense totalCount array uses
+ * uint64 elements. Only supported with the SoA layout (all new sketches);
+ * sketches with different counter widths cannot be combined.
+ */
+#define OMNISKETCH_FLAG_WIDE_COUNTS	0x0020
+
+/*
+ * The bucket positions for all sketchHeight rows are derived from a single
+ * XXH3 128-bit hash of the column value hash, using the h1 + i*h2 double
+ * hashing construction, instead of a chain of d separate XXH32 calls (one
+ * per row). That removes most of the hashing from the hot add/estimate
+ * loops. The scheme has to match between ingest and the estimates, so it's
+ * part of the stored format - sketches built by older versions keep using
+ * the per-row XXH32 chain.
+ */
+#define OMNISKETCH_FLAG_DOUBLE_HASH	0x0040
+
+/*
+ * Windowed (sliding-window) sketch - a ring of per-epoch sub-sketches in a
+ * single value, reusing the regular per-attribute layout (the sub-sketch
+ * index is slot * nattrs + attribute, with slot = epoch % nepochs). Each
+ * slot holds the records of one epoch label, so answering "last N epochs"
+ * queries needs no query-time merge - advancing the window simply zeroes
+ * the slots of the expired epochs (see omnisketch_advance) and reuses them
+ * for the new labels. The ring descriptor is stored in another maxaligned
+ * slot right after the 64-bit record count - windowed sketches always use
+ * wide counters (they exist for long-lived streams). The record count
+ * tracks the records still live in the window.
+ */
+#define OMNISKETCH_FLAG_WINDOW		0x0080
+
+#define SKETCH_HAS_HASHES(s)	(((s)->flags & OMNISKETCH_FLAG_HASHES) != 0)
+#define SKETCH_HAS_POW2_WIDTH(s)	(((s)->flags & OMNISKETCH_FLAG_POW2_WIDTH) != 0)
+#define SKETCH_IS_PACKED(s)		(((s)->flags & OMNISKETCH_FLAG_PACKED) != 0)
+#define SKETCH_HAS_NARROW_ITEMS(s)	(((s)->flags & OMNISKETCH_FLAG_NARROW_ITEMS) != 0)
+#define SKETCH_HAS_SOA(s)		(((s)->flags & OMNISKETCH_FLAG_SOA) != 0)
+#define SKETCH_HAS_WIDE_COUNTS(s)	(((s)->flags & OMNISKETCH_FLAG_WIDE_COUNTS) != 0)
+#define SKETCH_HAS_DOUBLE_HASH(s)	(((s)->flags & OMNISKETCH_FLAG_DOUBLE_HASH) != 0)
+#define SKETCH_HAS_WINDOW(s)	(((s)->flags & OMNISKETCH_FLAG_WINDOW) != 0)
+
+/*
+ * Bits 16-23 of the flags hold the number of dyadic levels built for the
+ * first (range) attribute of the sketch - 0 means a plain equality-only
+ * sketch. Kept in the flags so that the header layout does not change.
+ *
+ * A range sketch stores one sub-sketch per dyadic level for the first
+ * attribute (level l indexes the value prefixes "value >> l"), followed
+ * by one sub-sketch for each remaining (equality) attribute, all using
+ * the regular SKETCH_BUCKET_INDEX / SKETCH_SAMPLE addressing. So the record
+ * has (numSketches - rangeBits + 1) attributes.
+ */
+#define SKETCH_RANGE_BITS(s)	(((s)->flags >> 16) & 0xFF)
+#define SKETCH_RANGE_BITS_MASK	0x00FF0000
+
+/* bytes per stored item (the narrow format rounds itemSize up to bytes) */
+#define SKETCH_ITEM_BYTES(s)	\
+	(SKETCH_HAS_NARROW_ITEMS(s) ? (Size) (((s)->itemSize + 7) / 8) : sizeof(int32))
+
 #define SKETCH_SIZE(s)	\
 	((s)->sketchWidth * (s)->sketchHeight)
 
+#define SKETCH_NBUCKETS(s)	\
+	(SKETCH_SIZE(s) * (s)->numSketches)
+
+/*
+ * Size of the header, including the 64-bit record count stored right after
+ * the struct for wide-counter sketches (the int32 count field in the header
+ * is unused there) and the ring descriptor of windowed sketches. The data
+ * offsets below all start at this.
+ */
+#define SKETCH_HEADER_BYTES(s)	\
+	(MAXALIGN(sizeof(omnisketch_t)) + \
+	 (SKETCH_HAS_WIDE_COUNTS(s) ? MAXALIGN(sizeof(int64)) : 0) + \
+	 (SKETCH_HAS_WINDOW(s) ? MAXALIGN(sizeof(int64)) : 0))
+
+/* the record count of a wide-counter sketch */
+#define SKETCH_COUNT64(s)	\
+	(*(int64 *) ((char *) (s) + MAXALIGN(sizeof(omnisketch_t))))
+
+/* the ring descriptor of a windowed sketch (see OMNISKETCH_FLAG_WINDOW) */
+typedef struct omnisketch_window_t
+{
+	int32		nepochs;		/* number of epochs live at a time */
+	int32		epoch;			/* current (most recent) epoch label */
+} omnisketch_window_t;
+
+/* stored in the header slot after the count (windowed implies wide counts) */
+StaticAssertDecl(sizeof(omnisketch_window_t) <= MAXALIGN(sizeof(int64)),
+				 "window descriptor must fit into one maxaligned slot");
+
+#define SKETCH_WINDOW(s)	\
+	((omnisketch_window_t *) ((char *) (s) + \
+		MAXALIGN(sizeof(omnisketch_t)) + MAXALIGN(sizeof(int64))))
+
+/* bytes per stored bucket counter (in the SoA totalCount array) */
+#define SKETCH_COUNTER_BYTES(s)	\
+	(SKETCH_HAS_WIDE_COUNTS(s) ? sizeof(uint64) : sizeof(uint32))
+
+/* size of the bucket metadata region (depends on the layout) */
+#define SKETCH_BUCKETS_BYTES(s)	\
+	(SKETCH_HAS_SOA(s) ? \
+	 (MAXALIGN(SKETCH_NBUCKETS(s) * SKETCH_COUNTER_BYTES(s)) + \
+	  MAXALIGN(SKETCH_NBUCKETS(s) * sizeof(uint16))) : \
+	 MAXALIGN(SKETCH_NBUCKETS(s) * sizeof(bucket_disk_t)))
+
+/* array of bucket_disk_t structs (only without OMNISKETCH_FLAG_SOA) */
 #define SKETCH_BUCKETS(s)	\
-	((bucket_t *) ((char *) (s) + \
-		MAXALIGN(sizeof(omnisketch_t))))
+	((bucket_disk_t *) ((char *) (s) + \
+		SKETCH_HEADER_BYTES(s)))
+
+/* the dense counter arrays (only with OMNISKETCH_FLAG_SOA) */
+#define SKETCH_TOTAL_COUNTS(s)	\
+	((uint32 *) ((char *) (s) + \
+		SKETCH_HEADER_BYTES(s)))
+
+#define SKETCH_TOTAL_COUNTS64(s)	\
+	((uint64 *) ((char *) (s) + \
+		SKETCH_HEADER_BYTES(s)))
+
+#define SKETCH_SAMPLE_COUNTS(s)	\
+	((uint16 *) ((char *) (s) + \
+		SKETCH_HEADER_BYTES(s) + \
+		MAXALIGN(SKETCH_NBUCKETS(s) * SKETCH_COUNTER_BYTES(s))))
 
 #define SKETCH_SAMPLES(s)	\
-	((int32 *) ((char *) (s) + \
-		MAXALIGN(sizeof(omnisketch_t)) + \
-		MAXALIGN(SKETCH_SIZE(s) * (s)->numSketches * sizeof(bucket_t))))
+	((char *) (s) + \
+		SKETCH_HEADER_BYTES(s) + \
+		SKETCH_BUCKETS_BYTES(s))
 
 #define SKETCH_BUCKET_INDEX(s, a, i, j)	\
 		((a) * SKETCH_SIZE(s) + (i) * (s)->sketchWidth + (j))
 
-#define SKETCH_BUCKET(s, a, i, j)	\
-	(&(SKETCH_BUCKETS(s))[SKETCH_BUCKET_INDEX(s, a, i, j)])
-
 #define SKETCH_SAMPLE(s, a, i, j)	\
-	(&SKETCH_SAMPLES(s)[SKETCH_BUCKET_INDEX(s, a, i, j) * (s)->sampleSize])
+	((void *) (SKETCH_SAMPLES(s) + \
+		SKETCH_BUCKET_INDEX(s, a, i, j) * (s)->sampleSize * SKETCH_ITEM_BYTES(s)))
+
+/* hashes of the sampled items (only with OMNISKETCH_FLAG_HASHES) */
+#define SKETCH_HASHES(s)	\
+	((uint32 *) ((char *) (s) + \
+		SKETCH_HEADER_BYTES(s) + \
+		SKETCH_BUCKETS_BYTES(s) + \
+		MAXALIGN(SKETCH_NBUCKETS(s) * SKETCH_ITEM_BYTES(s) * (s)->sampleSize)))
+
+#define SKETCH_SAMPLE_HASHES(s, a, i, j)	\
+	(SKETCH_HAS_HASHES(s) ? \
+	 &SKETCH_HASHES(s)[SKETCH_BUCKET_INDEX(s, a, i, j) * (s)->sampleSize] : NULL)
 
 #define SKETCH_SEED			0xFFFFFFFF
 #define SKETCH_HASH(v, s)	(uint32) XXH32(&(v), sizeof(uint32), (s))
 
 /* prototypes */
 PG_FUNCTION_INFO_V1(omnisketch_add);
+PG_FUNCTION_INFO_V1(omnisketch_add_wide);
+PG_FUNCTION_INFO_V1(omnisketch_add_budget);
+PG_FUNCTION_INFO_V1(omnisketch_add_batch);
+PG_FUNCTION_INFO_V1(omnisketch_add_range);
+PG_FUNCTION_INFO_V1(omnisketch_add_window);
+PG_FUNCTION_INFO_V1(omnisketch_add_record);
+
+PG_FUNCTION_INFO_V1(omnisketch_advance);
 
 PG_FUNCTION_INFO_V1(omnisketch_combine);
 PG_FUNCTION_INFO_V1(omnisketch_finalize);
 
+PG_FUNCTION_INFO_V1(omnisketch_merge_accum);
+PG_FUNCTION_INFO_V1(omnisketch_merge_combine);
+PG_FUNCTION_INFO_V1(omnisketch_merge_serial);
+PG_FUNCTION_INFO_V1(omnisketch_merge_deserial);
+PG_FUNCTION_INFO_V1(omnisketch_merge_final);
+
+PG_FUNCTION_INFO_V1(omnisketch_pack);
+PG_FUNCTION_INFO_V1(omnisketch_unpack);
+
 PG_FUNCTION_INFO_V1(omnisketch_in);
 PG_FUNCTION_INFO_V1(omnisketch_out);
 PG_FUNCTION_INFO_V1(omnisketch_send);
@@ -101,14 +428,35 @@ PG_FUNCTION_INFO_V1(omnisketch_recv);
 
 PG_FUNCTION_INFO_V1(omnisketch_count);
 PG_FUNCTION_INFO_V1(omnisketch_estimate);
+PG_FUNCTION_INFO_V1(omnisketch_estimate_batch);
+PG_FUNCTION_INFO_V1(omnisketch_estimate_range);
 PG_FUNCTION_INFO_V1(omnisketch_text);
 PG_FUNCTION_INFO_V1(omnisketch_json);
+PG_FUNCTION_INFO_V1(omnisketch_stats);
+PG_FUNCTION_INFO_V1(omnisketch_buckets);
 
 Datum omnisketch_add(PG_FUNCTION_ARGS);
+Datum omnisketch_add_wide(PG_FUNCTION_ARGS);
+Datum omnisketch_add_budget(PG_FUNCTION_ARGS);
+Datum omnisketch_add_batch(PG_FUNCTION_ARGS);
+Datum omnisketch_add_range(PG_FUNCTION_ARGS);
+Datum omnisketch_add_window(PG_FUNCTION_ARGS);
+Datum omnisketch_add_record(PG_FUNCTION_ARGS);
+
+Datum omnisketch_advance(PG_FUNCTION_ARGS);
 
 Datum omnisketch_combine(PG_FUNCTION_ARGS);
 Datum omnisketch_finalize(PG_FUNCTION_ARGS);
 
+Datum omnisketch_merge_accum(PG_FUNCTION_ARGS);
+Datum omnisketch_merge_combine(PG_FUNCTION_ARGS);
+Datum omnisketch_merge_serial(PG_FUNCTION_ARGS);
+Datum omnisketch_merge_deserial(PG_FUNCTION_ARGS);
+Datum omnisketch_merge_final(PG_FUNCTION_ARGS);
+
+Datum omnisketch_pack(PG_FUNCTION_ARGS);
+Datum omnisketch_unpack(PG_FUNCTION_ARGS);
+
 Datum omnisketch_in(PG_FUNCTION_ARGS);
 Datum omnisketch_out(PG_FUNCTION_ARGS);
 Datum omnisketch_send(PG_FUNCTION_ARGS);
@@ -116,23 +464,263 @@ Datum omnisketch_recv(PG_FUNCTION_ARGS);
 
 Datum omnisketch_count(PG_FUNCTION_ARGS);
 Datum omnisketch_estimate(PG_FUNCTION_ARGS);
+Datum omnisketch_estimate_batch(PG_FUNCTION_ARGS);
+Datum omnisketch_estimate_range(PG_FUNCTION_ARGS);
 Datum omnisketch_text(PG_FUNCTION_ARGS);
 Datum omnisketch_json(PG_FUNCTION_ARGS);
+Datum omnisketch_stats(PG_FUNCTION_ARGS);
+Datum omnisketch_buckets(PG_FUNCTION_ARGS);
 
 #define EULER_NUMBER	2.71828
 
+static omnisketch_t *omnisketch_unpack_sketch(omnisketch_t *packed);
+static void omnisketch_free_items(item_list_t *items);
+
+/*
+ * Get a valid omnisketch struct, with full 4B header, expanding the packed
+ * on-disk format if needed. If not needed, use just plain PG_GETARG_POINTER.
+ */
+static omnisketch_t *
+omnisketch_detoast(Datum d)
+{
+	omnisketch_t *sketch = (omnisketch_t *) PG_DETOAST_DATUM(d);
+
+	if (SKETCH_IS_PACKED(sketch))
+		sketch = omnisketch_unpack_sketch(sketch);
+
+	return sketch;
+}
+
+#define PG_GETARG_OMNISKETCH(x)	omnisketch_detoast(PG_GETARG_DATUM(x))
+
+/*
+ * Sliced access to a stored sketch. An estimate only touches numSketches
+ * * sketchHeight buckets, but detoasting the argument reads the whole
+ * (possibly multi-megabyte) varlena from the TOAST table. For sketches
+ * stored out of line and not compressed, every bucket's offset is
+ * computable from the header alone, so the estimate can fetch just the
+ * header and then the individual bucket slices it actually probes.
+ *
+ * This does not work for the packed format (no computable offsets) or
+ * compressed storage (a slice would decompress the prefix anyway) - the
+ * callers fall back to the regular full detoast in those cases.
+ */
+typedef struct omnisketch_slice_t
+{
+	Datum			value;		/* the original (still toasted) datum */
+	omnisketch_t   *hdr;		/* copy of the sketch header */
+} omnisketch_slice_t;
+
+/*
+ * Fetch a slice of the flat sketch into the caller's buffer. The offset
+ * is in terms of the in-memory layout (i.e. including the varlena
+ * header), matching what the SKETCH_* macros compute.
+ */
+static void
+omnisketch_fetch_slice(Datum value, Size offset, Size len, void *dst)
+{
+	bytea  *chunk = (bytea *) PG_DETOAST_DATUM_SLICE(value,
+													 (int32) (offset - VARHDRSZ),
+													 (int32) len);
+
+	Assert(VARSIZE_ANY_EXHDR(chunk) == len);
+
+	memcpy(dst, VARDATA_ANY(chunk), len);
+
+	pfree(chunk);
+}
+
+/*
+ * Decide if the sketch value supports sliced access, and if so fetch the
+ * header. Returns false when the caller should just detoast the whole
+ * value the regular way.
+ */
+static bool
+omnisketch_slice_begin(Datum value, omnisketch_slice_t *slice)
+{
+	struct varlena *attr = (struct varlena *) DatumGetPointer(value);
+	struct varatt_external toast_pointer;
+	omnisketch_t   *hdr;
+
+	/* in memory (or inline) - the regular detoast is cheap enough */
+	if (!VARATT_IS_EXTERNAL_ONDISK(attr))
+		return false;
+
+	VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+
+	if (VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer))
+		return false;
+
+	/*
+	 * Fetch the header, plus the extra bytes holding the 64-bit record
+	 * count of wide-counter sketches and the ring descriptor of windowed
+	 * sketches (we only know whether the sketch has those after looking at
+	 * the flags, and every sketch is larger than the extended header
+	 * anyway).
+	 */
+	hdr = (omnisketch_t *) PG_DETOAST_DATUM_SLICE(value, 0,
+						(int32) (MAXALIGN(sizeof(omnisketch_t)) +
+								 2 * MAXALIGN(sizeof(int64)) - VARHDRSZ));
+
+	if (SKETCH_IS_PACKED(hdr))
+	{
+		pfree(hdr);
+		return false;
+	}
+
+	slice->value = value;
+	slice->hdr = hdr;
+
+	return true;
+}
+
+/*
+ * Read/write the k-th item of a sample. With narrow items the value is
+ * stored in SKETCH_ITEM_BYTES bytes, assembled byte by byte so the format
+ * does not depend on endianness; otherwise it's a plain int32 array.
+ */
+static inline int32
+sketch_sample_get(omnisketch_t *sketch, const void *sample, int k)
+{
+	if (SKETCH_HAS_NARROW_ITEMS(sketch))
+	{
+		int			nbytes = (sketch->itemSize + 7) / 8;
+		const uint8 *ptr = (const uint8 *) sample + (k * nbytes);
+		uint32		item = 0;
+
+		for (int b = 0; b < nbytes; b++)
+			item |= ((uint32) ptr[b]) << (8 * b);
+
+		return (int32) item;
+	}
+
+	return ((const int32 *) sample)[k];
+}
+
+static inline void
+sketch_sample_set(omnisketch_t *sketch, void *sample, int k, int32 item)
+{
+	if (SKETCH_HAS_NARROW_ITEMS(sketch))
+	{
+		int			nbytes = (sketch->itemSize + 7) / 8;
+		uint8	   *ptr = (uint8 *) sample + (k * nbytes);
+
+		for (int b = 0; b < nbytes; b++)
+			ptr[b] = (uint8) (((uint32) item) >> (8 * b));
+
+		return;
+	}
+
+	((int32 *) sample)[k] = item;
+}
+
+/* hash of the k-th sampled item (stored, or computed on the fly) */
+static inline uint32
+sample_item_hash(omnisketch_t *sketch, const void *sample,
+				 const uint32 *hashes, int k)
+{
+	int32		item;
+
+	if (hashes != NULL)
+		return hashes[k];
+
+	item = sketch_sample_get(sketch, sample, k);
+
+	return SKETCH_HASH(item, SKETCH_SEED);
+}
+
+/*
+ * Load / store the metadata of a bucket (identified by its global index,
+ * see SKETCH_BUCKET_INDEX). With the SoA layout only the two counters are
+ * actually stored - the ordering fields are derived (the samples are kept
+ * sorted by hash, so the maximum is the last element, and its hash is the
+ * last stored hash). The callers operate on a local bucket_t copy and
+ * store it back when they modify the counters.
+ */
+static inline void
+sketch_bucket_load(omnisketch_t *sketch, int idx, bucket_t *bucket)
+{
+	if (SKETCH_HAS_SOA(sketch))
+	{
+		uint16	count = SKETCH_SAMPLE_COUNTS(sketch)[idx];
+
+		if (SKETCH_HAS_WIDE_COUNTS(sketch))
+			bucket->totalCount = SKETCH_TOTAL_COUNTS64(sketch)[idx];
+		else
+			bucket->totalCount = SKETCH_TOTAL_COUNTS(sketch)[idx];
+		bucket->sampleCount = count;
+		bucket->maxIndex = (count > 0) ? (count - 1) : 0;
+		bucket->isSorted = (count > 0);
+		bucket->maxHash = (count > 0) ?
+			SKETCH_HASHES(sketch)[idx * sketch->sampleSize + (count - 1)] : 0;
+
+		return;
+	}
+
+	{
+		bucket_disk_t *disk = &SKETCH_BUCKETS(sketch)[idx];
+
+		bucket->totalCount = disk->totalCount;
+		bucket->sampleCount = disk->sampleCount;
+		bucket->maxIndex = disk->maxIndex;
+		bucket->maxHash = disk->maxHash;
+		bucket->isSorted = disk->isSorted;
+	}
+}
+
+static inline void
+sketch_bucket_store(omnisketch_t *sketch, int idx, const bucket_t *bucket)
+{
+	if (SKETCH_HAS_SOA(sketch))
+	{
+		if (SKETCH_HAS_WIDE_COUNTS(sketch))
+			SKETCH_TOTAL_COUNTS64(sketch)[idx] = bucket->totalCount;
+		else
+			SKETCH_TOTAL_COUNTS(sketch)[idx] = (uint32) bucket->totalCount;
+		SKETCH_SAMPLE_COUNTS(sketch)[idx] = bucket->sampleCount;
+
+		return;
+	}
+
+	{
+		bucket_disk_t *disk = &SKETCH_BUCKETS(sketch)[idx];
+
+		disk->totalCount = (uint32) bucket->totalCount;
+		disk->sampleCount = bucket->sampleCount;
+		disk->maxIndex = bucket->maxIndex;
+		disk->maxHash = bucket->maxHash;
+		disk->isSorted = bucket->isSorted;
+	}
+}
+
 /*
- * Get a valid omnisketch struct, with full 4B header. If not needed, use
- * just plain PG_GETARG_POINTER.
+ * The record count of the sketch - a regular sketch uses the int32 header
+ * field, a wide-counter sketch the 64-bit value stored after the header.
  */
-#define PG_GETARG_OMNISKETCH(x)	(omnisketch_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(x))
+static inline int64
+sketch_get_count(omnisketch_t *sketch)
+{
+	if (SKETCH_HAS_WIDE_COUNTS(sketch))
+		return SKETCH_COUNT64(sketch);
+
+	return sketch->count;
+}
+
+static inline void
+sketch_add_count(omnisketch_t *sketch, int64 delta)
+{
+	if (SKETCH_HAS_WIDE_COUNTS(sketch))
+		SKETCH_COUNT64(sketch) += delta;
+	else
+		sketch->count += (int32) delta;
+}
 
 #ifdef USE_ASSERT_CHECKING
 static void
 AssertCheckBucketBasic(omnisketch_t *sketch, bucket_t *bucket)
 {
 	Assert(bucket->totalCount >= bucket->sampleCount);
-	Assert(bucket->totalCount <= sketch->count);
+	Assert(bucket->totalCount <= (uint64) sketch_get_count(sketch));
 	Assert(bucket->sampleCount <= sketch->sampleSize);
 	Assert(bucket->maxIndex <= bucket->sampleCount);	/* count can be 0 */
 }
@@ -143,13 +731,17 @@ AssertCheckBucketBasic(omnisketch_t *sketch, bucket_t *bucket)
  *
  * - items are expected to be sorted by hash, etc.
  * - the cached maximum hash value matches the actual value for one item
+ * - the stored hashes (if any) match the items
  * - there are not more than sampleSize items
  */
 static void
-AssertCheckBucket(omnisketch_t *sketch, bucket_t *bucket, int32 *sample)
+AssertCheckBucket(omnisketch_t *sketch, bucket_t *bucket, void *sample,
+				  uint32 *hashes)
 {
 #ifdef USE_ASSERT_CHECKING
 	uint32		h_prev;
+	int32		item_prev = 0;
+	int32		maxItem;
 
 	/* check basic bucket info */
 	AssertCheckBucketBasic(sketch, bucket);
@@ -166,7 +758,8 @@ AssertCheckBucket(omnisketch_t *sketch, bucket_t *bucket, int32 *sample)
 
 	/* Make sure the max hash is valid (there's at least one item). */
 	Assert(bucket->maxIndex < bucket->sampleCount);
-	Assert(bucket->maxHash == SKETCH_HASH(sample[bucket->maxIndex], SKETCH_SEED));
+	maxItem = sketch_sample_get(sketch, sample, bucket->maxIndex);
+	Assert(bucket->maxHash == SKETCH_HASH(maxItem, SKETCH_SEED));
 
 	/* if sorted, the max hash is at the very end of the list */
 	Assert(!bucket->isSorted || (bucket->maxIndex == (bucket->sampleCount - 1)));
@@ -177,7 +770,11 @@ AssertCheckBucket(omnisketch_t *sketch, bucket_t *bucket, int32 *sample)
 	 */
 	for (int i = 0; i < bucket->sampleCount; i++)
 	{
-		uint32	h = SKETCH_HASH(sample[i], SKETCH_SEED);
+		int32	item = sketch_sample_get(sketch, sample, i);
+		uint32	h = SKETCH_HASH(item, SKETCH_SEED);
+
+		/* the stored hash (if any) has to match the item */
+		Assert((hashes == NULL) || (hashes[i] == h));
 
 		Assert(h <= bucket->maxHash);
 
@@ -185,14 +782,15 @@ AssertCheckBucket(omnisketch_t *sketch, bucket_t *bucket, int32 *sample)
 		if ((i > 0) && bucket->isSorted)
 		{
 			Assert((h > h_prev) ||
-				   ((h == h_prev) && (sample[i] > sample[i-1])));
+				   ((h == h_prev) && (item > item_prev)));
 		}
 		else if (i > 0)
 		{
-			Assert(sample[i] != sample[i-1]);
+			Assert(item != item_prev);
 		}
 
 		h_prev = h;
+		item_prev = item;
 	}
 #endif
 }
@@ -202,50 +800,110 @@ static void
 AssertCheckSketch(omnisketch_t *sketch)
 {
 #ifdef USE_ASSERT_CHECKING
-	for (int a = 0; a < sketch->numSketches; a++)
+	/*
+	 * In a windowed sketch each epoch slot only holds a part of the (live)
+	 * records, so the per-row sums only add up to the record count across
+	 * all the slots of an attribute. A regular sketch is the nepochs = 1
+	 * case of the same check.
+	 */
+	int		nepochs = SKETCH_HAS_WINDOW(sketch) ?
+		SKETCH_WINDOW(sketch)->nepochs : 1;
+	int		nattrs = sketch->numSketches / Max(nepochs, 1);
+
+	for (int a = 0; a < nattrs; a++)
 	{
 		for (int i = 0; i < sketch->sketchHeight; i++)
 		{
 			int64	count = 0;
 
-			for (int j = 0; j < sketch->sketchWidth; j++)
+			for (int e = 0; e < nepochs; e++)
 			{
-				bucket_t *bucket = SKETCH_BUCKET(sketch, a, i, j);
+				for (int j = 0; j < sketch->sketchWidth; j++)
+				{
+					bucket_t	bucket;
 
-				AssertCheckBucketBasic(sketch, bucket);
+					sketch_bucket_load(sketch,
+									   SKETCH_BUCKET_INDEX(sketch, e * nattrs + a, i, j),
+									   &bucket);
 
-				count += bucket->totalCount;
+					AssertCheckBucketBasic(sketch, &bucket);
+
+					count += bucket.totalCount;
+				}
 			}
 
-			Assert(sketch->count == count);
+			Assert(sketch_get_count(sketch) == count);
 		}
 	}
 #endif
 }
 
 /*
- * Allocate omnisketch with enough space for a requested number of items.
- *
- * FIXME This ignores the itemSize, and just uses 32bit IDs all the time.
+ * Size of the flat sketch with the given parameters, in bytes. A windowed
+ * sketch (windowEpochs > 0) only differs by the header slot for the ring
+ * descriptor - the per-epoch sub-sketches are already counted in nsketches.
  */
-static omnisketch_t *
-omnisketch_allocate(int nsketches, int width, int height, int sampleSize, int itemSize)
+static Size
+omnisketch_size_bytes(int nsketches, int width, int height, int sampleSize,
+					  int itemSize, bool narrowItems, bool wideCounts,
+					  int windowEpochs)
 {
-	omnisketch_t *sketch;
+	Size	itemBytes = narrowItems ? ((itemSize + 7) / 8) : sizeof(int32);
+	Size	counterBytes = wideCounts ? sizeof(uint64) : sizeof(uint32);
 
 	/* header shared by all per-attribute sketches */
 	Size	len = MAXALIGN(sizeof(omnisketch_t));
 
-	/* counts */
-	len += MAXALIGN(nsketches * width * height * sizeof(bucket_t));
+	/* the 64-bit record count (see OMNISKETCH_FLAG_WIDE_COUNTS) */
+	if (wideCounts)
+		len += MAXALIGN(sizeof(int64));
+
+	/* the ring descriptor (see OMNISKETCH_FLAG_WINDOW) */
+	if (windowEpochs > 0)
+		len += MAXALIGN(sizeof(int64));
+
+	/* counts (the SoA arrays, see OMNISKETCH_FLAG_SOA) */
+	len += MAXALIGN(nsketches * width * height * counterBytes);
+	len += MAXALIGN(nsketches * width * height * sizeof(uint16));
 
 	/* samples */
-	len += MAXALIGN(nsketches * width * height * sizeof(int32) * sampleSize);
+	len += MAXALIGN(nsketches * width * height * itemBytes * sampleSize);
 
-	/* make sure to zero the struct, to keep it compressible */
-	sketch = palloc0(len);
+	/* hashes of the sampled items */
+	len += MAXALIGN(nsketches * width * height * sizeof(uint32) * sampleSize);
 
-	SET_VARSIZE(sketch, len);
+	return len;
+}
+
+/*
+ * Initialize the fixed-size sketch header (flags, dimensions, seed). Shared
+ * by the flat sketch and the sparse transition state, which embeds the same
+ * header so the ID generation and bucket selection work on either form.
+ */
+static void
+omnisketch_init_header(omnisketch_t *sketch, int nsketches, int width,
+					   int height, int sampleSize, int itemSize,
+					   bool narrowItems, bool wideCounts, int windowEpochs)
+{
+	sketch->flags = (OMNISKETCH_FLAG_HASHES |
+					 OMNISKETCH_FLAG_SOA |
+					 OMNISKETCH_FLAG_DOUBLE_HASH);
+
+	/* width may use the cheap mask-based bucket selection */
+	if ((width & (width - 1)) == 0)
+		sketch->flags |= OMNISKETCH_FLAG_POW2_WIDTH;
+
+	if (narrowItems)
+		sketch->flags |= OMNISKETCH_FLAG_NARROW_ITEMS;
+
+	if (wideCounts)
+		sketch->flags |= OMNISKETCH_FLAG_WIDE_COUNTS;
+
+	if (windowEpochs > 0)
+	{
+		Assert(wideCounts);
+		sketch->flags |= OMNISKETCH_FLAG_WINDOW;
+	}
 
 	sketch->numSketches = nsketches;
 	sketch->sketchWidth = width;
@@ -258,6 +916,45 @@ omnisketch_allocate(int nsketches, int width, int height, int sampleSize, int it
 #else
 	sketch->seed = random();
 #endif
+}
+
+/*
+ * Allocate omnisketch with enough space for a requested number of items.
+ *
+ * With narrowItems the samples store each item in just enough bytes for
+ * itemSize bits. New sketches always use that (the IDs are masked to
+ * itemSize bits, see omnisketch_next_id), but when rebuilding a sketch
+ * from a serialized form the flag has to match the source - older
+ * sketches have full 32-bit IDs that don't fit the narrow slots.
+ */
+static omnisketch_t *
+omnisketch_allocate(int nsketches, int width, int height, int sampleSize,
+					int itemSize, bool narrowItems, bool wideCounts,
+					int windowEpochs)
+{
+	omnisketch_t *sketch;
+	Size	len = omnisketch_size_bytes(nsketches, width, height, sampleSize,
+										itemSize, narrowItems, wideCounts,
+										windowEpochs);
+
+	/* the flat sketch is a varlena value, enforce the allocation limit */
+	if (len > MaxAllocSize)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("sketch size %zu exceeds the maximum allowed (%zu)",
+						len, (Size) MaxAllocSize)));
+
+	/* make sure to zero the struct, to keep it compressible */
+	sketch = palloc0(len);
+
+	SET_VARSIZE(sketch, len);
+
+	omnisketch_init_header(sketch, nsketches, width, height, sampleSize,
+						   itemSize, narrowItems, wideCounts, windowEpochs);
+
+	/* the ring descriptor (the current epoch is up to the caller) */
+	if (windowEpochs > 0)
+		SKETCH_WINDOW(sketch)->nepochs = windowEpochs;
 
 	AssertCheckSketch(sketch);
 
@@ -265,372 +962,476 @@ omnisketch_allocate(int nsketches, int width, int height, int sampleSize, int it
 }
 
 /*
- * Add an ID into the sample, possibly updating the max hash for the bucket.
- *
- * If the sample is not full (there are fewer than sampleSize items), add the
- * item into the array, and update the max hash value.
- *
- * If the sample is full, consider the hash value and only add the item if
- * the hash is less than the current max hash.
- *
- * Updates the sample size.
+ * Determine the sketch parameters for the requested accuracy.
  *
- * FIXME make sure to reset the isSorted flag.
+ * With a positive memory budget (in bytes), the parameters are scaled
+ * down until the sketch fits into the budget - trading accuracy for a
+ * predictable, bounded amount of memory (e.g. for aggregates with many
+ * groups). A budget of 0 means no limit, other than the 1GB cap on the
+ * allocation enforced by omnisketch_allocate.
  */
 static void
-omnisketch_sample_add(omnisketch_t *sketch, bucket_t *bucket, int32 *sample, uint32 item)
+omnisketch_params(int ncolumns, double epsilon, double delta,
+				  int64 budget, bool wideCounts,
+				  int *wp, int *dp, int *Bp, int *bp)
 {
+	int			w, d, B, b;
+
+	/* section 3.2 in the paper (configuring the sketch) */
+	d = ceil(log(2.0 / delta));
+	w = 1.0 + ceil(EULER_NUMBER * pow((epsilon + 1.0) / epsilon, 1.0 / d));
+
+	/* pick the bucket/item sizes */
+	B=0;
+	b=0;
+	while (b < 32 && B < 1024)
+	{
+		B += 1;
+		b = ceil(log(4 * pow(B, 2.5) / delta));
+	}
+
 	/*
-	 * XXX is it necessary / good idea to use the seed? maybe the seed should
-	 * be calculated from the parameters, to make it harder to construct an
-	 * adversary data set?
-	 *
-	 * XXX The reason why the seed is not 0 or a small number, is that we use
-	 * those seeds for calculating the buckets (columns), so it seems reasonable
-	 * to use something different.
+	 * Round the width up to the next power of two, so that the bucket
+	 * selection in the hot loops can use a mask instead of a modulo by a
+	 * runtime-variable divisor. The sketch gets a bit larger, but a larger
+	 * width only makes the estimates more accurate.
 	 */
-	uint32	h = SKETCH_HASH(item, SKETCH_SEED);
+	w = pg_nextpower2_32(w);
 
-	/*
-	 * Add the item to the sample, depending on the hash compared to the max
-	 * hash for the bucket.
-	 */
-	if (bucket->sampleCount < sketch->sampleSize)
+	if (budget > 0)
 	{
-		if (bucket->sampleCount == 0)
-		{
-			bucket->maxIndex = 0;
-			bucket->maxHash = h;
-		}
-		else if (h > bucket->maxHash)
+		/* never exceed the varlena / allocation limit either */
+		budget = Min(budget, (int64) MaxAllocSize);
+
+		/*
+		 * Shrink the sketch until it fits into the budget. First reduce
+		 * the per-bucket samples (recomputing the matching item size),
+		 * then halve the width (keeping it a power of two), and finally
+		 * drop rows. That's roughly the order of increasing impact on
+		 * the estimates - smaller samples only limit how small fractions
+		 * the sketch can estimate, while fewer/smaller rows make the
+		 * buckets (and thus the estimates) less selective.
+		 */
+		while ((B > 16) &&
+			   (omnisketch_size_bytes(ncolumns, w, d, B, b, (b < 32), wideCounts, 0) > budget))
 		{
-			bucket->maxIndex = bucket->sampleCount;
-			bucket->maxHash = h;
+			B -= 1;
+			b = ceil(log(4 * pow(B, 2.5) / delta));
 		}
 
-		sample[bucket->sampleCount++] = item;
+		while ((w > 2) &&
+			   (omnisketch_size_bytes(ncolumns, w, d, B, b, (b < 32), wideCounts, 0) > budget))
+			w /= 2;
+
+		while ((d > 1) &&
+			   (omnisketch_size_bytes(ncolumns, w, d, B, b, (b < 32), wideCounts, 0) > budget))
+			d -= 1;
 
-		AssertCheckBucket(sketch, bucket, sample);
+		if (omnisketch_size_bytes(ncolumns, w, d, B, b, (b < 32), wideCounts, 0) > budget)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("memory budget %lld is too small for a sketch on %d attributes",
+							(long long) budget, ncolumns)));
 	}
-	else if (h < bucket->maxHash)
-	{
-		/*
-		 * Replace the current max (because that's the one we want to get rid
-		 * of), and calculate the new maximum. We don't know if the new item
-		 * has the max, so we have to walk the whole array. Shouldn't be very
-		 * common case, most items will have hash greater than the current max.
-		 *
-		 * FIXME if the hash is exactly the same (unlikely but possible), we
-		 * should compare the them too, i.e. sort by (hash, item). Should
-		 * make the behavior more consistent (but hash equality, aka collision,
-		 * is a very rare case, so not very important).
-		 */
-		sample[bucket->maxIndex] = item;
 
-		bucket->maxHash = 0;
-		for (int k = 0; k < bucket->sampleCount; k++)
-		{
-			h = SKETCH_HASH(sample[k], SKETCH_SEED);
+	*wp = w;
+	*dp = d;
+	*Bp = B;
+	*bp = b;
+}
 
-			if (h >= bucket->maxHash)
-			{
-				bucket->maxHash = h;
-				bucket->maxIndex = k;
-			}
-		}
+/* determine the sketch parameters and allocate the (flat) sketch */
+static omnisketch_t *
+omnisketch_create_internal(int ncolumns, double epsilon, double delta,
+						   int64 budget, bool wideCounts)
+{
+	int			w, d, B, b;
 
-		AssertCheckBucket(sketch, bucket, sample);
-	}
+	omnisketch_params(ncolumns, epsilon, delta, budget, wideCounts,
+					  &w, &d, &B, &b);
+
+	return omnisketch_allocate(ncolumns, w, d, B, b, (b < 32), wideCounts, 0);
+}
+
+static omnisketch_t *
+omnisketch_create(int ncolumns, double epsilon, double delta)
+{
+	return omnisketch_create_internal(ncolumns, epsilon, delta, 0, false);
 }
 
 /*
- * Add hash and item to the bucket and the associated sample.
+ * Create a windowed sketch - a ring of "nepochs" per-epoch sub-sketches for
+ * each record attribute, all in one flat value (see OMNISKETCH_FLAG_WINDOW).
+ * The per-epoch sub-sketches use the regular per-attribute layout, so all
+ * the bucket addressing works unchanged with the combined sub-sketch index.
+ * Windowed sketches always use wide counters - they exist for long-lived
+ * streams. The "epoch" is the label of the current (most recent) epoch.
  */
-static void
-omnisketch_add_hash(omnisketch_t *sketch, int column, uint32 hash, uint32 item)
+static omnisketch_t *
+omnisketch_create_window(int ncolumns, double epsilon, double delta,
+						 int nepochs, int epoch)
 {
-	for (int i = 0; i < sketch->sketchHeight; i++)
-	{
-		bucket_t   *bucket;
-		int32	   *sample;
+	omnisketch_t *sketch;
+	int			w, d, B, b;
 
-		uint32	h = (uint32) SKETCH_HASH(hash, i);
-		int		j = (h % sketch->sketchWidth);
+	if ((int64) ncolumns * nepochs > PG_INT16_MAX)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many epochs for a sketch on %d attributes",
+						ncolumns)));
 
-		Assert(i >= 0 && i < sketch->sketchHeight);
-		Assert(j >= 0 && j < sketch->sketchWidth);
+	omnisketch_params(ncolumns, epsilon, delta, 0, true, &w, &d, &B, &b);
 
-		bucket = SKETCH_BUCKET(sketch, column, i, j);
-		sample = SKETCH_SAMPLE(sketch, column, i, j);
+	sketch = omnisketch_allocate(ncolumns * nepochs, w, d, B, b, (b < 32),
+								 true, nepochs);
 
-		bucket->totalCount++;
+	SKETCH_WINDOW(sketch)->epoch = epoch;
 
-		omnisketch_sample_add(sketch, bucket, sample, item);
-	}
+	return sketch;
 }
 
-/* add a value to the omnisketch */
-Datum
-omnisketch_add(PG_FUNCTION_ARGS)
+/*
+ * Advance a windowed sketch to the given epoch, retiring the epochs that
+ * fall out of the window. The retired slots (those about to be reused for
+ * the new labels) are simply zeroed - a few memsets of contiguous regions,
+ * O(sketch size) in the worst case - and their records are subtracted from
+ * the live record count. Advancing by more than the ring length resets the
+ * whole sketch.
+ */
+static void
+omnisketch_advance_sketch(omnisketch_t *sketch, int epoch)
 {
-	omnisketch_t   *sketch = NULL;
-	uint32			id;
-	HeapTupleHeader	record = PG_GETARG_HEAPTUPLEHEADER(3);
+	omnisketch_window_t *window = SKETCH_WINDOW(sketch);
+	int			nattrs = sketch->numSketches / window->nepochs;
+	int64		steps;
 
-	Oid			tupType;
-	int32		tupTypmod;
-	TupleDesc	tupdesc;
-	HeapTupleData tuple;
-	int			ncolumns;
-	TypeCacheEntry **my_extra;
-	Datum	   *values;
-	bool	   *nulls;
-	uint32		element_hash;
+	Assert(SKETCH_HAS_WINDOW(sketch));
+	Assert(SKETCH_HAS_SOA(sketch) && SKETCH_HAS_WIDE_COUNTS(sketch));
 
-	/* Build temporary HeapTuple control structure */
-	tuple.t_len = HeapTupleHeaderGetDatumLength(record);
-	ItemPointerSetInvalid(&(tuple.t_self));
-	tuple.t_tableOid = InvalidOid;
-	tuple.t_data = record;
+	if (epoch < window->epoch)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot advance sketch to an older epoch (%d < %d)",
+						epoch, window->epoch)));
 
-	tupType = HeapTupleHeaderGetTypeId(record);
-	tupTypmod = HeapTupleHeaderGetTypMod(record);
-	tupdesc = lookup_rowtype_tupdesc(tupType, tupTypmod);
-	ncolumns = tupdesc->natts;
+	/* advancing by more than the ring length clears every slot once */
+	steps = Min((int64) epoch - window->epoch, (int64) window->nepochs);
 
-	/* make sure to have a sketch */
-	if (PG_ARGISNULL(0))
+	for (int64 k = 1; k <= steps; k++)
 	{
-		int			w, d, B, b;
-		double		epsilon, delta;
+		/* the slot the expired label shares with the new one replacing it */
+		int		slot = (int) ((uint32) (window->epoch + k) % window->nepochs);
 
-		/* */
-		epsilon = PG_GETARG_FLOAT8(1);
-		delta = PG_GETARG_FLOAT8(2);
+		/* buckets of the slot (all its attributes are adjacent) */
+		int		first = (slot * nattrs) * SKETCH_SIZE(sketch);
+		int		nbuckets = nattrs * SKETCH_SIZE(sketch);
 
-		/* section 3.2 in the paper (configuring the sketch) */
-		d = ceil(log(2.0 / delta));
-		w = 1.0 + ceil(EULER_NUMBER * pow((epsilon + 1.0) / epsilon, 1.0 / d));
+		/*
+		 * The retired records are no longer live. Every record of the slot
+		 * lands in exactly one bucket of each row, so the first row of the
+		 * slot's first attribute sums to the slot's record count.
+		 */
+		for (int i = 0; i < sketch->sketchWidth; i++)
+			SKETCH_COUNT64(sketch) -= SKETCH_TOTAL_COUNTS64(sketch)[first + i];
+
+		memset(&SKETCH_TOTAL_COUNTS64(sketch)[first], 0,
+			   nbuckets * sizeof(uint64));
+		memset(&SKETCH_SAMPLE_COUNTS(sketch)[first], 0,
+			   nbuckets * sizeof(uint16));
+		memset(SKETCH_SAMPLES(sketch) +
+			   (Size) first * sketch->sampleSize * SKETCH_ITEM_BYTES(sketch), 0,
+			   (Size) nbuckets * sketch->sampleSize * SKETCH_ITEM_BYTES(sketch));
+		memset(&SKETCH_HASHES(sketch)[(Size) first * sketch->sampleSize], 0,
+			   (Size) nbuckets * sketch->sampleSize * sizeof(uint32));
+	}
 
-		/* pick the bucket/item sizes */
-		B=0;
-		b=0;
-		while (b < 32 && B < 1024)
-		{
-			B += 1;
-			b = ceil(log(4 * pow(B, 2.5) / delta));
-		}
+	window->epoch = epoch;
 
-		sketch = omnisketch_allocate(ncolumns, w, d, B, b);
-	}
-	else
-	{
-		sketch = PG_GETARG_OMNISKETCH(0);
-	}
+	AssertCheckSketch(sketch);
+}
 
-	Assert(sketch != NULL);
+/*
+ * Create the sparse transition state (in the current memory context) - the
+ * sketch header and the dense counter arrays, with the samples allocated
+ * lazily as the buckets fill up (see omnisketch_sparse_add_hash). The 1GB
+ * limit is checked against the flat result right away, so the aggregate
+ * can't build a state it would fail to flatten.
+ */
+static omnisketch_sparse_t *
+omnisketch_sparse_create(int ncolumns, double epsilon, double delta,
+						 int64 budget, bool wideCounts)
+{
+	omnisketch_sparse_t *sparse;
+	int			w, d, B, b;
+	int			nbuckets;
+	Size		len;
 
-	if (sketch->numSketches != ncolumns)
-		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
-			 ncolumns, sketch->numSketches);
+	omnisketch_params(ncolumns, epsilon, delta, budget, wideCounts,
+					  &w, &d, &B, &b);
 
-	/* increment the number of records added to the sketch */
-	sketch->count++;
-	id = XXH32(&sketch->count, sizeof(uint32), sketch->seed);
+	len = omnisketch_size_bytes(ncolumns, w, d, B, b, (b < 32), wideCounts, 0);
 
-	my_extra = (TypeCacheEntry **) fcinfo->flinfo->fn_extra;
-	if (my_extra == NULL)
-	{
-		my_extra =
-			MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
-								   sizeof(TypeCacheEntry *) * ncolumns);
-		fcinfo->flinfo->fn_extra = my_extra;
-	}
+	if (len > MaxAllocSize)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("sketch size %zu exceeds the maximum allowed (%zu)",
+						len, (Size) MaxAllocSize)));
 
-	/* Break down the tuple into fields */
-	values = (Datum *) palloc(ncolumns * sizeof(Datum));
-	nulls = (bool *) palloc(ncolumns * sizeof(bool));
-	heap_deform_tuple(&tuple, tupdesc, values, nulls);
+	sparse = palloc0(sizeof(omnisketch_sparse_t));
 
-	for (int i = 0; i < ncolumns; i++)
-	{
-		Form_pg_attribute att;
-		TypeCacheEntry *typentry;
+	omnisketch_init_header(&sparse->hdr, ncolumns, w, d, B, b,
+						   (b < 32), wideCounts, 0);
 
-		att = TupleDescAttr(tupdesc, i);
+	sparse->cxt = CurrentMemoryContext;
 
-		if (att->attisdropped)
-			continue;
+	nbuckets = SKETCH_NBUCKETS(&sparse->hdr);
 
-		/*
-		 * Lookup the hash function if not done already
-		 */
-		typentry = my_extra[i];
-		if (typentry == NULL ||
-			typentry->type_id != att->atttypid)
-		{
-			typentry = lookup_type_cache(att->atttypid,
-										 TYPECACHE_HASH_EXTENDED_PROC_FINFO);
-			if (!OidIsValid(typentry->hash_extended_proc_finfo.fn_oid))
-				ereport(ERROR,
-						(errcode(ERRCODE_UNDEFINED_FUNCTION),
-						 errmsg("could not identify an extended hash function for type %s",
-								format_type_be(typentry->type_id))));
-			my_extra[i] = typentry;
-		}
+	sparse->totalCounts = palloc0(nbuckets * sizeof(uint64));
+	sparse->sampleCounts = palloc0(nbuckets * sizeof(uint16));
+	sparse->chunks = palloc0(nbuckets * sizeof(omnisketch_chunk_t *));
 
-		/* Compute hash of element */
-		if (nulls[i])
-		{
-			// FIXME handle NULL
-			element_hash = 0;
-		}
-		else
-		{
-			LOCAL_FCINFO(locfcinfo, 2);
-
-			InitFunctionCallInfoData(*locfcinfo, &typentry->hash_extended_proc_finfo, 2,
-									 att->attcollation, NULL, NULL);
-			locfcinfo->args[0].value = values[i];
-			locfcinfo->args[0].isnull = false;
-			locfcinfo->args[1].value = Int64GetDatum(0);
-			locfcinfo->args[0].isnull = false;
-			element_hash = DatumGetUInt64(FunctionCallInvoke(locfcinfo));
-
-			/* We don't expect hash support functions to return null */
-			Assert(!locfcinfo->isnull);
-		}
+	return sparse;
+}
 
-		omnisketch_add_hash(sketch, i, element_hash, id);
-	}
+/*
+ * Make sure the chunk has room for at least one more item - double the
+ * capacity (capped to the sample size, a full sample never grows further),
+ * or start with a small initial chunk for an empty bucket.
+ */
+static omnisketch_chunk_t *
+omnisketch_chunk_grow(omnisketch_sparse_t *sparse, omnisketch_chunk_t *chunk)
+{
+	omnisketch_chunk_t *newchunk;
+	Size		itemBytes = SKETCH_ITEM_BYTES(&sparse->hdr);
+	uint32		capacity;
 
-	pfree(values);
-	pfree(nulls);
-	ReleaseTupleDesc(tupdesc);
+	capacity = (chunk != NULL) ? (2 * chunk->capacity) : CHUNK_INITIAL_SIZE;
+	capacity = Min(capacity, (uint32) sparse->hdr.sampleSize);
 
-	/* Avoid leaking memory when handed toasted input. */
-	// PG_FREE_IF_COPY(record, 0);
+	newchunk = MemoryContextAlloc(sparse->cxt,
+								  offsetof(omnisketch_chunk_t, hashes) +
+								  capacity * (sizeof(uint32) + itemBytes));
+	newchunk->capacity = capacity;
 
-	AssertCheckSketch(sketch);
+	if (chunk != NULL)
+	{
+		memcpy(CHUNK_HASHES(newchunk), CHUNK_HASHES(chunk),
+			   chunk->capacity * sizeof(uint32));
+		memcpy(CHUNK_ITEMS(newchunk), CHUNK_ITEMS(chunk),
+			   chunk->capacity * itemBytes);
+		pfree(chunk);
+	}
 
-	// FIXME
-	PG_RETURN_POINTER(sketch);
+	return newchunk;
+}
+
+/* size of the flat sketch the sparse state flattens into */
+static Size
+omnisketch_sparse_flat_size(omnisketch_sparse_t *sparse)
+{
+	omnisketch_t *hdr = &sparse->hdr;
+
+	return omnisketch_size_bytes(hdr->numSketches, hdr->sketchWidth,
+								 hdr->sketchHeight, hdr->sampleSize,
+								 hdr->itemSize,
+								 SKETCH_HAS_NARROW_ITEMS(hdr),
+								 SKETCH_HAS_WIDE_COUNTS(hdr), 0);
 }
 
 /*
- * compare (hash, item) lexicographically - first by hash, then by item
+ * Flatten the sparse state into the regular dense layout. The chunks store
+ * the samples exactly like the flat sketch (already sorted by hash), so
+ * this just lays out the counters and copies the sampled items into their
+ * reserved slots.
  */
-static int
-cmp_item_hash(const void *a, const void *b)
+static void
+omnisketch_sparse_flatten_into(omnisketch_sparse_t *sparse,
+							   omnisketch_t *sketch, Size len)
 {
-	item_hash_t *ia = (item_hash_t *) a;
-	item_hash_t *ib = (item_hash_t *) b;
+	int			nbuckets = SKETCH_NBUCKETS(&sparse->hdr);
+	Size		itemBytes = SKETCH_ITEM_BYTES(&sparse->hdr);
 
-	if (ia->hash < ib->hash)
-		return -1;
-	else if (ia->hash > ib->hash)
-		return 1;
+	Assert(len == omnisketch_sparse_flat_size(sparse));
 
-	if (ia->item < ib->item)
-		return -1;
-	else if (ia->item > ib->item)
-		return 1;
+	/* make sure to zero the value, to keep it compressible */
+	memset(sketch, 0, len);
 
-	/* FIXME duplicate item IDs shouldn't really happen, right? */
-	return 0;
+	memcpy(sketch, &sparse->hdr, sizeof(omnisketch_t));
+	SET_VARSIZE(sketch, len);
+
+	if (SKETCH_HAS_WIDE_COUNTS(sketch))
+		SKETCH_COUNT64(sketch) = sparse->count64;
+
+	for (int idx = 0; idx < nbuckets; idx++)
+	{
+		omnisketch_chunk_t *chunk = sparse->chunks[idx];
+		uint16		count = sparse->sampleCounts[idx];
+
+		if (SKETCH_HAS_WIDE_COUNTS(sketch))
+			SKETCH_TOTAL_COUNTS64(sketch)[idx] = sparse->totalCounts[idx];
+		else
+			SKETCH_TOTAL_COUNTS(sketch)[idx] = (uint32) sparse->totalCounts[idx];
+
+		SKETCH_SAMPLE_COUNTS(sketch)[idx] = count;
+
+		if (count == 0)
+			continue;
+
+		memcpy(SKETCH_SAMPLES(sketch) + idx * sketch->sampleSize * itemBytes,
+			   CHUNK_ITEMS(chunk), count * itemBytes);
+		memcpy(&SKETCH_HASHES(sketch)[idx * sketch->sampleSize],
+			   CHUNK_HASHES(chunk), count * sizeof(uint32));
+	}
+
+	AssertCheckSketch(sketch);
 }
 
-/*
- * Returns the items sorted by hash. The elements are pairs (item,hash), so
- * that the hash does not need to be recalculated - both for sorting, and
- * later.
- */
-static item_hash_t *
-omnisketch_sorted_items(bucket_t *bucket, int32 *items)
+/* flatten the sparse state into a newly allocated flat sketch */
+static omnisketch_t *
+omnisketch_sparse_flatten(omnisketch_sparse_t *sparse)
 {
-	item_hash_t *sorted;
+	Size			len = omnisketch_sparse_flat_size(sparse);
+	omnisketch_t   *sketch = palloc(len);
 
-	sorted = palloc(bucket->sampleCount * sizeof(item_hash_t));
+	omnisketch_sparse_flatten_into(sparse, sketch, len);
 
-	for (int k = 0; k < bucket->sampleCount; k++)
+	return sketch;
+}
+
+/* release the sparse state (the chunks may be a lot of memory) */
+static void
+omnisketch_sparse_free(omnisketch_sparse_t *sparse)
+{
+	int			nbuckets = SKETCH_NBUCKETS(&sparse->hdr);
+
+	for (int idx = 0; idx < nbuckets; idx++)
 	{
-		sorted[k].item = items[k];
-		sorted[k].hash = SKETCH_HASH(items[k], SKETCH_SEED);
+		if (sparse->chunks[idx] != NULL)
+			pfree(sparse->chunks[idx]);
 	}
 
-	if (!bucket->isSorted)
-		pg_qsort(sorted, bucket->sampleCount, sizeof(item_hash_t), cmp_item_hash);
-
-	return sorted;
+	pfree(sparse->chunks);
+	pfree(sparse->sampleCounts);
+	pfree(sparse->totalCounts);
+	pfree(sparse);
 }
 
-/*
- * make sure samples for all buckets are sorted
- */
-Datum
-omnisketch_finalize(PG_FUNCTION_ARGS)
+/* basic checks on the sparse state (proper sum of counts, ...) */
+static void
+AssertCheckSparse(omnisketch_sparse_t *sparse)
 {
-	omnisketch_t *sketch = PG_GETARG_OMNISKETCH(0);
+#ifdef USE_ASSERT_CHECKING
+	omnisketch_t *sketch = &sparse->hdr;
 
-	for (int i = 0; i < sketch->numSketches; i++)
+	for (int a = 0; a < sketch->numSketches; a++)
 	{
-		for (int j = 0; j < sketch->sketchHeight; j++)
+		for (int i = 0; i < sketch->sketchHeight; i++)
 		{
-			for (int k = 0; k < sketch->sketchWidth; k++)
+			uint64	count = 0;
+
+			for (int j = 0; j < sketch->sketchWidth; j++)
 			{
-				bucket_t   *bucket = SKETCH_BUCKET(sketch, i, j, k);
-				int32	   *sample = SKETCH_SAMPLE(sketch, i, j, k);
+				int		idx = SKETCH_BUCKET_INDEX(sketch, a, i, j);
 
-				/* nothing to do if already sorted */
-				if (bucket->isSorted)
-					continue;
+				Assert(sparse->totalCounts[idx] >= sparse->sampleCounts[idx]);
+				Assert(sparse->sampleCounts[idx] <= sketch->sampleSize);
 
-				/*
-				 * sort the item lists, so that we can calculate intersection
-				 * more efficiently in _estimate
-				 *
-				 * XXX Not sure it's worth it to construct the separate array
-				 * with hash. If the hash function is sufficiently cheap, maybe
-				 * we should simply calculate the hashes ad hoc. Or maybe we
-				 * could leverage knowing if the array is presorted? (say, once
-				 * we add a new item into already-sorted array, we only replace
-				 * the max hash, which is the last element of the sample array).
-				 */
-				if (bucket->sampleCount >= 2)
-				{
-					item_hash_t *items;
+				count += sparse->totalCounts[idx];
+			}
 
-					items = omnisketch_sorted_items(bucket, sample);
+			Assert((uint64) sketch_get_count(sketch) == count);
+		}
+	}
+#endif
+}
 
-					for (int l = 0; l < bucket->sampleCount; l++)
-						sample[l] = items[l].item;
+/*
+ * Generate the ID for the next record added to the sketch, masked down to
+ * itemSize bits for sketches with narrow items (that's all the bits the
+ * samples store, and per the paper itemSize bits keep the IDs unique with
+ * high probability anyway). Increments the record count, which also seeds
+ * the ID sequence.
+ */
+static inline uint32
+omnisketch_next_id(omnisketch_t *sketch)
+{
+	uint32		id;
 
-					pfree(items);
+	sketch_add_count(sketch, 1);
 
-					/* the largest hash is at the very end */
-					bucket->maxIndex = (bucket->sampleCount - 1);
-					bucket->isSorted = true;
+	if (SKETCH_HAS_WIDE_COUNTS(sketch))
+	{
+		int64	count = SKETCH_COUNT64(sketch);
 
-					AssertCheckBucket(sketch, bucket, sample);
-				}
-			}
-		}
+		id = XXH32(&count, sizeof(int64), sketch->seed);
 	}
+	else
+		id = XXH32(&sketch->count, sizeof(uint32), sketch->seed);
 
-	AssertCheckSketch(sketch);
+	if (SKETCH_HAS_NARROW_ITEMS(sketch))
+		id &= (((uint32) 1 << sketch->itemSize) - 1);
 
-	PG_RETURN_POINTER(sketch);
+	return id;
 }
 
-/* compare sketch parameters, make sure it's the same / compatible */
-static bool
-omnisketch_equals(omnisketch_t *a, omnisketch_t *b)
+/* map a hash to a bucket (column) - cheap mask for power-of-two widths */
+static inline int
+omnisketch_bucket_column(omnisketch_t *sketch, uint32 h)
 {
-	return ((a->numSketches == b->numSketches) &&
-			(a->sketchHeight == b->sketchHeight) &&
-			(a->sketchWidth == b->sketchWidth) &&
-			(a->sampleSize == b->sampleSize) &&
-			(a->itemSize == b->itemSize));
+	if (SKETCH_HAS_POW2_WIDTH(sketch))
+		return (int) (h & (uint32) (sketch->sketchWidth - 1));
+
+	return (int) (h % (uint32) sketch->sketchWidth);
+}
+
+/*
+ * Bucket-selection state for one column value - the two 32-bit halves for
+ * the double-hashing construction (see OMNISKETCH_FLAG_DOUBLE_HASH), or
+ * the value hash itself for the legacy per-row XXH32 chain. The legacy
+ * case is marked by h2 = 0, which the double-hashing h2 can never be (it
+ * is forced odd, so the probed positions cycle through power-of-two
+ * widths too).
+ */
+typedef struct omnisketch_pos_t
+{
+	uint32		h1;
+	uint32		h2;
+} omnisketch_pos_t;
+
+/* derive the bucket positions for all the rows from the value hash */
+static inline omnisketch_pos_t
+omnisketch_bucket_positions(omnisketch_t *sketch, uint32 hash)
+{
+	omnisketch_pos_t pos;
+
+	if (SKETCH_HAS_DOUBLE_HASH(sketch))
+	{
+		XXH128_hash_t h = XXH3_128bits(&hash, sizeof(uint32));
+
+		pos.h1 = (uint32) h.low64;
+		pos.h2 = ((uint32) h.high64) | 1;
+	}
+	else
+	{
+		pos.h1 = hash;
+		pos.h2 = 0;
+	}
+
+	return pos;
+}
+
+/* the bucket (column) probed in the i-th row */
+static inline int
+omnisketch_bucket_position(omnisketch_t *sketch, omnisketch_pos_t pos, int i)
+{
+	uint32		h;
+
+	if (pos.h2 != 0)
+		h = pos.h1 + (uint32) i * pos.h2;
+	else
+		h = (uint32) SKETCH_HASH(pos.h1, i);
+
+	return omnisketch_bucket_column(sketch, h);
 }
 
 /* copy the sketch into the current memory context */
@@ -647,319 +1448,3729 @@ omnisketch_copy(omnisketch_t *sketch)
 	return dst;
 }
 
-/* merge two buckets, the first bucket is updated */
-static void
-omnisketch_merge_buckets(omnisketch_t *dst, omnisketch_t *src,
-						 bucket_t *dst_bucket, bucket_t *src_bucket,
-						 int32 *dst_sample, int32 *src_sample,
-						 int sampleSize)
+/* methods for the expanded representation of the sketch */
+
+static Size
+omnisketch_expanded_get_flat_size(ExpandedObjectHeader *eohptr)
+{
+	omnisketch_expanded_t *esketch = (omnisketch_expanded_t *) eohptr;
+
+	Assert(esketch->magic == OMNISKETCH_MAGIC);
+
+	if (esketch->sparse != NULL)
+		return omnisketch_sparse_flat_size(esketch->sparse);
+
+	Assert(esketch->sketch != NULL);
+
+	return VARSIZE(esketch->sketch);
+}
+
+static void
+omnisketch_expanded_flatten_into(ExpandedObjectHeader *eohptr,
+								 void *result, Size allocated_size)
+{
+	omnisketch_expanded_t *esketch = (omnisketch_expanded_t *) eohptr;
+
+	Assert(esketch->magic == OMNISKETCH_MAGIC);
+
+	if (esketch->sparse != NULL)
+	{
+		omnisketch_sparse_flatten_into(esketch->sparse, result, allocated_size);
+		return;
+	}
+
+	Assert(allocated_size == VARSIZE(esketch->sketch));
+
+	memcpy(result, esketch->sketch, allocated_size);
+}
+
+static const ExpandedObjectMethods omnisketch_expanded_methods = {
+	omnisketch_expanded_get_flat_size,
+	omnisketch_expanded_flatten_into
+};
+
+/*
+ * Build an expanded sketch in a new memory context (a child of the given
+ * parent context - for aggregates that should be the aggregate context, so
+ * that nodeAgg recognizes the object and keeps it between transition calls
+ * instead of copying it).
+ *
+ * The flat sketch (if not NULL) is copied into the object - callers that
+ * don't have a sketch yet pass NULL and allocate it later, directly in the
+ * hdr.eoh_context memory context.
+ */
+static omnisketch_expanded_t *
+omnisketch_expand(omnisketch_t *sketch, MemoryContext parentcontext)
+{
+	omnisketch_expanded_t *esketch;
+	MemoryContext	objcxt;
+	MemoryContext	oldcontext;
+
+	objcxt = AllocSetContextCreate(parentcontext,
+								   "expanded omnisketch",
+								   ALLOCSET_DEFAULT_SIZES);
+
+	esketch = (omnisketch_expanded_t *)
+		MemoryContextAlloc(objcxt, sizeof(omnisketch_expanded_t));
+
+	EOH_init_header(&esketch->hdr, &omnisketch_expanded_methods, objcxt);
+	esketch->magic = OMNISKETCH_MAGIC;
+	esketch->sketch = NULL;
+	esketch->sparse = NULL;
+
+	if (sketch != NULL)
+	{
+		oldcontext = MemoryContextSwitchTo(objcxt);
+		esketch->sketch = omnisketch_copy(sketch);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	return esketch;
+}
+
+/*
+ * Get the expanded sketch for a transition argument. If the argument already
+ * is a read-write expanded omnisketch, just use it (and update it in place).
+ * Otherwise expand the flat value - that should only happen once, for the
+ * first call seeing the value.
+ */
+static omnisketch_expanded_t *
+omnisketch_get_expanded(Datum d, MemoryContext parentcontext)
+{
+	if (VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(d)))
+	{
+		omnisketch_expanded_t *esketch
+			= (omnisketch_expanded_t *) DatumGetEOHP(d);
+
+		if (esketch->magic == OMNISKETCH_MAGIC)
+			return esketch;
+	}
+
+	return omnisketch_expand(omnisketch_detoast(d), parentcontext);
+}
+
+/* find the position for (h, item) in a sample sorted by (hash, item) */
+static int
+omnisketch_sample_position(omnisketch_t *sketch, void *sample,
+						   const uint32 *hashes, int count,
+						   uint32 h, int32 item)
+{
+	int			start = 0,
+				end = count;
+
+	while (start < end)
+	{
+		int		mid = (start + end) / 2;
+		uint32	mh = hashes[mid];
+
+		if ((mh < h) ||
+			((mh == h) && (sketch_sample_get(sketch, sample, mid) < item)))
+			start = mid + 1;
+		else
+			end = mid;
+	}
+
+	return start;
+}
+
+/*
+ * Add an ID into the sample, possibly updating the max hash for the bucket.
+ *
+ * If the sample is not full (there are fewer than sampleSize items), add the
+ * item into the array, and update the max hash value.
+ *
+ * If the sample is full, consider the hash value and only add the item if
+ * the hash is less than the current max hash.
+ *
+ * Updates the sample size.
+ */
+static void
+omnisketch_sample_add(omnisketch_t *sketch, bucket_t *bucket, void *sample,
+					  uint32 *hashes, uint32 item)
+{
+	/*
+	 * XXX is it necessary / good idea to use the seed? maybe the seed should
+	 * be calculated from the parameters, to make it harder to construct an
+	 * adversary data set?
+	 *
+	 * XXX The reason why the seed is not 0 or a small number, is that we use
+	 * those seeds for calculating the buckets (columns), so it seems reasonable
+	 * to use something different.
+	 */
+	uint32	h = SKETCH_HASH(item, SKETCH_SEED);
+
+	/*
+	 * With stored hashes the sample is kept permanently sorted by (hash,
+	 * item) - each item is inserted into its position, shifting at most
+	 * sampleSize entries. That's cheaper than the full per-bucket sort
+	 * that finalize (and combine) would otherwise have to do, and with
+	 * a full sample the replaced maximum is simply the last element, so
+	 * there's no rescan to find the new maximum either.
+	 *
+	 * Samples of old sketches (without stored hashes) are maintained the
+	 * old way - appended, and sorted during finalize.
+	 */
+	if (hashes != NULL)
+	{
+		int			pos;
+		Size		ib = SKETCH_ITEM_BYTES(sketch);
+		char	   *base = (char *) sample;
+
+		if (bucket->sampleCount >= sketch->sampleSize)
+		{
+			/* sample full - the item only ever replaces the maximum */
+			if (h >= bucket->maxHash)
+				return;
+
+			/* forget the maximum, i.e. the last element */
+			bucket->sampleCount--;
+		}
+
+		pos = omnisketch_sample_position(sketch, sample, hashes,
+										 bucket->sampleCount, h, (int32) item);
+
+		memmove(base + (pos + 1) * ib, base + pos * ib,
+				(bucket->sampleCount - pos) * ib);
+		memmove(&hashes[pos + 1], &hashes[pos],
+				(bucket->sampleCount - pos) * sizeof(uint32));
+
+		sketch_sample_set(sketch, sample, pos, item);
+		hashes[pos] = h;
+
+		bucket->sampleCount++;
+		bucket->isSorted = true;
+		bucket->maxIndex = (bucket->sampleCount - 1);
+		bucket->maxHash = hashes[bucket->sampleCount - 1];
+
+		AssertCheckBucket(sketch, bucket, sample, hashes);
+
+		return;
+	}
+
+	/* only old sketches without stored hashes get here */
+	Assert(hashes == NULL);
+
+	/*
+	 * Add the item to the sample, depending on the hash compared to the max
+	 * hash for the bucket.
+	 */
+	if (bucket->sampleCount < sketch->sampleSize)
+	{
+		if (bucket->sampleCount == 0)
+		{
+			bucket->maxIndex = 0;
+			bucket->maxHash = h;
+		}
+		else if (h > bucket->maxHash)
+		{
+			bucket->maxIndex = bucket->sampleCount;
+			bucket->maxHash = h;
+		}
+
+		sketch_sample_set(sketch, sample, bucket->sampleCount, item);
+		bucket->sampleCount++;
+
+		AssertCheckBucket(sketch, bucket, sample, hashes);
+	}
+	else if (h < bucket->maxHash)
+	{
+		/*
+		 * Replace the current max (because that's the one we want to get rid
+		 * of), and calculate the new maximum. We don't know if the new item
+		 * has the max, so we have to walk the whole array. Shouldn't be very
+		 * common case, most items will have hash greater than the current max.
+		 *
+		 * FIXME if the hash is exactly the same (unlikely but possible), we
+		 * should compare the them too, i.e. sort by (hash, item). Should
+		 * make the behavior more consistent (but hash equality, aka collision,
+		 * is a very rare case, so not very important).
+		 */
+		sketch_sample_set(sketch, sample, bucket->maxIndex, item);
+
+		bucket->maxHash = 0;
+		for (int k = 0; k < bucket->sampleCount; k++)
+		{
+			h = sample_item_hash(sketch, sample, NULL, k);
+
+			if (h >= bucket->maxHash)
+			{
+				bucket->maxHash = h;
+				bucket->maxIndex = k;
+			}
+		}
+
+		AssertCheckBucket(sketch, bucket, sample, hashes);
+	}
+}
+
+/*
+ * Add hash and item to the bucket and the associated sample.
+ */
+static void
+omnisketch_add_hash(omnisketch_t *sketch, int column, uint32 hash, uint32 item)
+{
+	omnisketch_pos_t pos = omnisketch_bucket_positions(sketch, hash);
+
+	/*
+	 * Each row touches a couple of random locations in a structure that can
+	 * far exceed the CPU caches - the bucket counters, the sample and its
+	 * hashes. The coordinates for all the rows are computable up front from
+	 * the hashing state, so issue prefetches for all of them before doing
+	 * any of the updates - that way the cache misses overlap, instead of
+	 * being serialized across the rows. Re-deriving the position in the
+	 * update loop is a cheap multiply-add with double hashing, so only do
+	 * this for such sketches - with the legacy per-row XXH32 chain the
+	 * recomputation would cost about as much as the prefetch saves.
+	 */
+	if (SKETCH_HAS_DOUBLE_HASH(sketch) && SKETCH_HAS_SOA(sketch))
+	{
+		for (int i = 0; i < sketch->sketchHeight; i++)
+		{
+			int		j = omnisketch_bucket_position(sketch, pos, i);
+			int		idx = SKETCH_BUCKET_INDEX(sketch, column, i, j);
+
+			if (SKETCH_HAS_WIDE_COUNTS(sketch))
+				omnisketch_prefetch_write(&SKETCH_TOTAL_COUNTS64(sketch)[idx]);
+			else
+				omnisketch_prefetch_write(&SKETCH_TOTAL_COUNTS(sketch)[idx]);
+
+			omnisketch_prefetch_write(&SKETCH_SAMPLE_COUNTS(sketch)[idx]);
+			omnisketch_prefetch_write(SKETCH_SAMPLE(sketch, column, i, j));
+
+			if (SKETCH_HAS_HASHES(sketch))
+				omnisketch_prefetch_write(SKETCH_SAMPLE_HASHES(sketch, column, i, j));
+		}
+	}
+
+	for (int i = 0; i < sketch->sketchHeight; i++)
+	{
+		bucket_t	bucket;
+		void	   *sample;
+		uint32	   *hashes;
+		int			idx;
+
+		int		j = omnisketch_bucket_position(sketch, pos, i);
+
+		Assert(i >= 0 && i < sketch->sketchHeight);
+		Assert(j >= 0 && j < sketch->sketchWidth);
+
+		idx = SKETCH_BUCKET_INDEX(sketch, column, i, j);
+		sample = SKETCH_SAMPLE(sketch, column, i, j);
+		hashes = SKETCH_SAMPLE_HASHES(sketch, column, i, j);
+
+		sketch_bucket_load(sketch, idx, &bucket);
+
+		bucket.totalCount++;
+
+		omnisketch_sample_add(sketch, &bucket, sample, hashes, item);
+
+		sketch_bucket_store(sketch, idx, &bucket);
+	}
+}
+
+/*
+ * Same as omnisketch_add_hash, for the sparse transition state - the sample
+ * and hashes live in the per-bucket chunk, grown on demand. Once the sample
+ * is full the insert only ever replaces an existing item, so the chunk never
+ * needs to grow past the sample size.
+ */
+static void
+omnisketch_sparse_add_hash(omnisketch_sparse_t *sparse, int column,
+						   uint32 hash, uint32 item)
+{
+	omnisketch_t *sketch = &sparse->hdr;
+	omnisketch_pos_t pos = omnisketch_bucket_positions(sketch, hash);
+
+	/* prefetch the counters and chunk pointers, like omnisketch_add_hash */
+	for (int i = 0; i < sketch->sketchHeight; i++)
+	{
+		int		j = omnisketch_bucket_position(sketch, pos, i);
+		int		idx = SKETCH_BUCKET_INDEX(sketch, column, i, j);
+
+		omnisketch_prefetch_write(&sparse->totalCounts[idx]);
+		omnisketch_prefetch_write(&sparse->sampleCounts[idx]);
+		omnisketch_prefetch(&sparse->chunks[idx]);
+	}
+
+	for (int i = 0; i < sketch->sketchHeight; i++)
+	{
+		bucket_t	bucket;
+		omnisketch_chunk_t *chunk;
+		int			idx;
+
+		int		j = omnisketch_bucket_position(sketch, pos, i);
+
+		Assert(i >= 0 && i < sketch->sketchHeight);
+		Assert(j >= 0 && j < sketch->sketchWidth);
+
+		idx = SKETCH_BUCKET_INDEX(sketch, column, i, j);
+		chunk = sparse->chunks[idx];
+
+		if ((chunk == NULL) ||
+			((sparse->sampleCounts[idx] == chunk->capacity) &&
+			 (chunk->capacity < sketch->sampleSize)))
+			chunk = sparse->chunks[idx] = omnisketch_chunk_grow(sparse, chunk);
+
+		/* reconstruct the bucket, like sketch_bucket_load does */
+		bucket.totalCount = sparse->totalCounts[idx];
+		bucket.sampleCount = sparse->sampleCounts[idx];
+		bucket.maxIndex = (bucket.sampleCount > 0) ? (bucket.sampleCount - 1) : 0;
+		bucket.isSorted = (bucket.sampleCount > 0);
+		bucket.maxHash = (bucket.sampleCount > 0) ?
+			CHUNK_HASHES(chunk)[bucket.sampleCount - 1] : 0;
+
+		bucket.totalCount++;
+
+		omnisketch_sample_add(sketch, &bucket, CHUNK_ITEMS(chunk),
+							  CHUNK_HASHES(chunk), item);
+
+		sparse->totalCounts[idx] = bucket.totalCount;
+		sparse->sampleCounts[idx] = bucket.sampleCount;
+	}
+}
+
+/*
+ * Per-call scratch state for functions taking a record argument (the add
+ * transition functions and omnisketch_estimate), cached in fn_extra. The
+ * row-type lookup, the values/nulls arrays and the FunctionCallInfo for
+ * the per-column hash functions are all set up once for the first record
+ * and reused for every following call - the per-row work is then just a
+ * deform and the hash invocations, with no allocation or catalog access.
+ *
+ * The tuple descriptor is a copy (in fn_mcxt), so there is no refcount to
+ * release. The record type can't really change between the rows of one
+ * aggregate, but check anyway and rebuild the state if it does.
+ */
+typedef struct omnisketch_scratch_t
+{
+	Oid			tupType;		/* composite type of the records */
+	int32		tupTypmod;
+	TupleDesc	tupdesc;		/* copy of the row descriptor */
+	int			ncolumns;
+
+	Datum	   *values;			/* deformed fields of the current record */
+	bool	   *nulls;
+
+	/* per-column hash function calls (NULL for dropped columns) */
+	FunctionCallInfo *hashfcinfo;
+} omnisketch_scratch_t;
+
+static omnisketch_scratch_t *
+omnisketch_scratch_init(FunctionCallInfo fcinfo, HeapTupleHeader record)
+{
+	Oid			tupType = HeapTupleHeaderGetTypeId(record);
+	int32		tupTypmod = HeapTupleHeaderGetTypMod(record);
+	omnisketch_scratch_t *scratch;
+	MemoryContext	oldcontext;
+
+	scratch = (omnisketch_scratch_t *) fcinfo->flinfo->fn_extra;
+
+	/* fast path - already set up for this record type */
+	if ((scratch != NULL) &&
+		(scratch->tupType == tupType) &&
+		(scratch->tupTypmod == tupTypmod))
+		return scratch;
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	if (scratch == NULL)
+	{
+		scratch = palloc0(sizeof(omnisketch_scratch_t));
+		fcinfo->flinfo->fn_extra = scratch;
+	}
+
+	scratch->tupType = tupType;
+	scratch->tupTypmod = tupTypmod;
+	scratch->tupdesc = lookup_rowtype_tupdesc_copy(tupType, tupTypmod);
+	scratch->ncolumns = scratch->tupdesc->natts;
+
+	scratch->values = palloc(scratch->ncolumns * sizeof(Datum));
+	scratch->nulls = palloc(scratch->ncolumns * sizeof(bool));
+	scratch->hashfcinfo = palloc0(scratch->ncolumns * sizeof(FunctionCallInfo));
+
+	for (int i = 0; i < scratch->ncolumns; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(scratch->tupdesc, i);
+		TypeCacheEntry *typentry;
+		FunctionCallInfo hashfcinfo;
+
+		if (att->attisdropped)
+			continue;
+
+		typentry = lookup_type_cache(att->atttypid,
+									 TYPECACHE_HASH_EXTENDED_PROC_FINFO);
+		if (!OidIsValid(typentry->hash_extended_proc_finfo.fn_oid))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_FUNCTION),
+					 errmsg("could not identify an extended hash function for type %s",
+							format_type_be(typentry->type_id))));
+
+		hashfcinfo = palloc0(SizeForFunctionCallInfo(2));
+		InitFunctionCallInfoData(*hashfcinfo,
+								 &typentry->hash_extended_proc_finfo, 2,
+								 att->attcollation, NULL, NULL);
+		hashfcinfo->args[1].value = Int64GetDatum(0);
+		hashfcinfo->args[1].isnull = false;
+
+		scratch->hashfcinfo[i] = hashfcinfo;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return scratch;
+}
+
+/* deform the record into the values/nulls arrays of the scratch state */
+static void
+omnisketch_scratch_deform(omnisketch_scratch_t *scratch, HeapTupleHeader record)
+{
+	HeapTupleData	tuple;
+
+	/* Build temporary HeapTuple control structure */
+	tuple.t_len = HeapTupleHeaderGetDatumLength(record);
+	ItemPointerSetInvalid(&(tuple.t_self));
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = record;
+
+	heap_deform_tuple(&tuple, scratch->tupdesc, scratch->values,
+					  scratch->nulls);
+}
+
+/* compute the hash of column "i" of the deformed record */
+static uint32
+omnisketch_scratch_hash(omnisketch_scratch_t *scratch, int i)
+{
+	FunctionCallInfo hashfcinfo = scratch->hashfcinfo[i];
+	uint32			hash;
+
+	if (scratch->nulls[i])
+	{
+		// FIXME handle NULL
+		return 0;
+	}
+
+	hashfcinfo->args[0].value = scratch->values[i];
+	hashfcinfo->args[0].isnull = false;
+	hashfcinfo->isnull = false;
+	hash = DatumGetUInt64(FunctionCallInvoke(hashfcinfo));
+
+	/* We don't expect hash support functions to return null */
+	Assert(!hashfcinfo->isnull);
+
+	return hash;
+}
+
+/*
+ * Add a value to the omnisketch. Shared by the regular aggregate and the
+ * wide-counter variant (omnisketch_wide) - the flag only matters for the
+ * call that creates the sketch.
+ */
+static Datum
+omnisketch_add_internal(FunctionCallInfo fcinfo, bool wideCounts)
+{
+	omnisketch_expanded_t *esketch;
+	omnisketch_t   *sketch = NULL;
+	MemoryContext	aggcontext;
+	uint32			id;
+	HeapTupleHeader	record = PG_GETARG_HEAPTUPLEHEADER(3);
+	omnisketch_scratch_t *scratch;
+	int				ncolumns;
+
+	scratch = omnisketch_scratch_init(fcinfo, record);
+	ncolumns = scratch->ncolumns;
+
+	/*
+	 * Make sure to have an expanded sketch, so that we can update it in
+	 * place. When not in an aggregate (e.g. when called directly), just
+	 * parent it to the current memory context - the result gets flattened
+	 * when stored, like any other expanded object.
+	 */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		aggcontext = CurrentMemoryContext;
+
+	if (PG_ARGISNULL(0))
+		esketch = omnisketch_expand(NULL, aggcontext);
+	else
+		esketch = omnisketch_get_expanded(PG_GETARG_DATUM(0), aggcontext);
+
+	/* make sure to have a sketch (new ones start sparse) */
+	if ((esketch->sketch == NULL) && (esketch->sparse == NULL))
+	{
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(esketch->hdr.eoh_context);
+		esketch->sparse = omnisketch_sparse_create(ncolumns,
+												   PG_GETARG_FLOAT8(1),
+												   PG_GETARG_FLOAT8(2),
+												   0, wideCounts);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	sketch = (esketch->sparse != NULL) ? &esketch->sparse->hdr : esketch->sketch;
+
+	Assert(sketch != NULL);
+
+	if (sketch->numSketches != ncolumns)
+		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+			 ncolumns, sketch->numSketches);
+
+	/* generate ID for the record (also counts the record as added) */
+	id = omnisketch_next_id(sketch);
+
+	/* Break down the tuple into fields */
+	omnisketch_scratch_deform(scratch, record);
+
+	for (int i = 0; i < ncolumns; i++)
+	{
+		uint32		element_hash;
+
+		/* dropped column */
+		if (scratch->hashfcinfo[i] == NULL)
+			continue;
+
+		element_hash = omnisketch_scratch_hash(scratch, i);
+
+		if (esketch->sparse != NULL)
+			omnisketch_sparse_add_hash(esketch->sparse, i, element_hash, id);
+		else
+			omnisketch_add_hash(sketch, i, element_hash, id);
+	}
+
+	/* Avoid leaking memory when handed toasted input. */
+	// PG_FREE_IF_COPY(record, 0);
+
+	if (esketch->sparse != NULL)
+		AssertCheckSparse(esketch->sparse);
+	else
+		AssertCheckSketch(sketch);
+
+	PG_RETURN_DATUM(EOHPGetRWDatum(&esketch->hdr));
+}
+
+/* add a value to the omnisketch */
+Datum
+omnisketch_add(PG_FUNCTION_ARGS)
+{
+	return omnisketch_add_internal(fcinfo, false);
+}
+
+/* same, but building a sketch with 64-bit counters */
+Datum
+omnisketch_add_wide(PG_FUNCTION_ARGS)
+{
+	return omnisketch_add_internal(fcinfo, true);
+}
+
+/*
+ * Same as omnisketch_add, except that the sketch is sized for an explicit
+ * memory budget (in bytes), not just the requested accuracy. The budget
+ * only matters for the call that creates the sketch, later calls simply
+ * add values to it.
+ */
+Datum
+omnisketch_add_budget(PG_FUNCTION_ARGS)
+{
+	omnisketch_expanded_t *esketch;
+	omnisketch_t   *sketch = NULL;
+	MemoryContext	aggcontext;
+	uint32			id;
+	int64			budget = PG_GETARG_INT64(3);
+	HeapTupleHeader	record = PG_GETARG_HEAPTUPLEHEADER(4);
+	omnisketch_scratch_t *scratch;
+	int				ncolumns;
+
+	if (budget <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("memory budget must be a positive number of bytes")));
+
+	scratch = omnisketch_scratch_init(fcinfo, record);
+	ncolumns = scratch->ncolumns;
+
+	/*
+	 * Make sure to have an expanded sketch, so that we can update it in
+	 * place. When not in an aggregate (e.g. when called directly), just
+	 * parent it to the current memory context - the result gets flattened
+	 * when stored, like any other expanded object.
+	 */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		aggcontext = CurrentMemoryContext;
+
+	if (PG_ARGISNULL(0))
+		esketch = omnisketch_expand(NULL, aggcontext);
+	else
+		esketch = omnisketch_get_expanded(PG_GETARG_DATUM(0), aggcontext);
+
+	/* make sure to have a sketch (new ones start sparse) */
+	if ((esketch->sketch == NULL) && (esketch->sparse == NULL))
+	{
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(esketch->hdr.eoh_context);
+		esketch->sparse = omnisketch_sparse_create(ncolumns,
+												   PG_GETARG_FLOAT8(1),
+												   PG_GETARG_FLOAT8(2),
+												   budget, false);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	sketch = (esketch->sparse != NULL) ? &esketch->sparse->hdr : esketch->sketch;
+
+	Assert(sketch != NULL);
+
+	if (sketch->numSketches != ncolumns)
+		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+			 ncolumns, sketch->numSketches);
+
+	/* generate ID for the record (also counts the record as added) */
+	id = omnisketch_next_id(sketch);
+
+	/* Break down the tuple into fields */
+	omnisketch_scratch_deform(scratch, record);
+
+	for (int i = 0; i < ncolumns; i++)
+	{
+		uint32		element_hash;
+
+		/* dropped column */
+		if (scratch->hashfcinfo[i] == NULL)
+			continue;
+
+		element_hash = omnisketch_scratch_hash(scratch, i);
+
+		if (esketch->sparse != NULL)
+			omnisketch_sparse_add_hash(esketch->sparse, i, element_hash, id);
+		else
+			omnisketch_add_hash(sketch, i, element_hash, id);
+	}
+
+	if (esketch->sparse != NULL)
+		AssertCheckSparse(esketch->sparse);
+	else
+		AssertCheckSketch(sketch);
+
+	PG_RETURN_DATUM(EOHPGetRWDatum(&esketch->hdr));
+}
+
+/*
+ * Add a batch of values (array of records) to the omnisketch.
+ *
+ * Unlike omnisketch_add, which is called (and has to expand the transition
+ * state, check the sketch and deform the record) once per row, this does
+ * the setup once per batch and then streams the rows into the sketch,
+ * which amortizes the per-row overhead for high-velocity ingest.
+ */
+Datum
+omnisketch_add_batch(PG_FUNCTION_ARGS)
+{
+	omnisketch_expanded_t *esketch = NULL;
+	omnisketch_t   *sketch = NULL;
+	MemoryContext	aggcontext;
+	ArrayType	   *batch;
+	ArrayIterator	iter;
+	Datum			value;
+	bool			isnull;
+
+	Oid			tupType = InvalidOid;
+	int32		tupTypmod = -1;
+	TupleDesc	tupdesc = NULL;
+	int			ncolumns = 0;
+	TypeCacheEntry **my_extra = NULL;
+	Datum	   *values = NULL;
+	bool	   *nulls = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		aggcontext = CurrentMemoryContext;
+
+	/* nothing to add, just return the current state */
+	if (PG_ARGISNULL(3))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	batch = PG_GETARG_ARRAYTYPE_P(3);
+
+	if (!type_is_rowtype(ARR_ELEMTYPE(batch)))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("omnisketch_add_batch expects an array of records")));
+
+	iter = array_create_iterator(batch, 0, NULL);
+
+	while (array_iterate(iter, &value, &isnull))
+	{
+		HeapTupleHeader	record;
+		HeapTupleData	tuple;
+		uint32			id;
+
+		/* ignore NULL records (no values to add) */
+		if (isnull)
+			continue;
+
+		record = DatumGetHeapTupleHeader(value);
+
+		/*
+		 * Lookup the tuple descriptor, unless we already have the right one
+		 * from the preceding elements (the common case - the elements of the
+		 * array have the same row type).
+		 */
+		if ((tupdesc == NULL) ||
+			(tupType != HeapTupleHeaderGetTypeId(record)) ||
+			(tupTypmod != HeapTupleHeaderGetTypMod(record)))
+		{
+			if (tupdesc != NULL)
+				ReleaseTupleDesc(tupdesc);
+
+			tupType = HeapTupleHeaderGetTypeId(record);
+			tupTypmod = HeapTupleHeaderGetTypMod(record);
+			tupdesc = lookup_rowtype_tupdesc(tupType, tupTypmod);
+
+			if ((ncolumns != 0) && (ncolumns != tupdesc->natts))
+				elog(ERROR, "number of record attributes mismatches batch (%d != %d)",
+					 tupdesc->natts, ncolumns);
+
+			ncolumns = tupdesc->natts;
+		}
+
+		/* first row - finish the setup we could not do without a tupdesc */
+		if (values == NULL)
+		{
+			/* make sure to have an expanded sketch to update in place */
+			if (PG_ARGISNULL(0))
+				esketch = omnisketch_expand(NULL, aggcontext);
+			else
+				esketch = omnisketch_get_expanded(PG_GETARG_DATUM(0), aggcontext);
+
+			/* make sure to have a sketch (new ones start sparse) */
+			if ((esketch->sketch == NULL) && (esketch->sparse == NULL))
+			{
+				MemoryContext oldcontext;
+
+				oldcontext = MemoryContextSwitchTo(esketch->hdr.eoh_context);
+				esketch->sparse = omnisketch_sparse_create(ncolumns,
+														   PG_GETARG_FLOAT8(1),
+														   PG_GETARG_FLOAT8(2),
+														   0, false);
+				MemoryContextSwitchTo(oldcontext);
+			}
+
+			sketch = (esketch->sparse != NULL) ? &esketch->sparse->hdr
+											   : esketch->sketch;
+
+			if (sketch->numSketches != ncolumns)
+				elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+					 ncolumns, sketch->numSketches);
+
+			my_extra = (TypeCacheEntry **) fcinfo->flinfo->fn_extra;
+			if (my_extra == NULL)
+			{
+				my_extra =
+					MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+										   sizeof(TypeCacheEntry *) * ncolumns);
+				fcinfo->flinfo->fn_extra = my_extra;
+			}
+
+			/* allocated once, reused for all the rows in the batch */
+			values = (Datum *) palloc(ncolumns * sizeof(Datum));
+			nulls = (bool *) palloc(ncolumns * sizeof(bool));
+		}
+
+		/* Build temporary HeapTuple control structure */
+		tuple.t_len = HeapTupleHeaderGetDatumLength(record);
+		ItemPointerSetInvalid(&(tuple.t_self));
+		tuple.t_tableOid = InvalidOid;
+		tuple.t_data = record;
+
+		/* generate ID for the record (also counts the record as added) */
+		id = omnisketch_next_id(sketch);
+
+		/* Break down the tuple into fields */
+		heap_deform_tuple(&tuple, tupdesc, values, nulls);
+
+		for (int i = 0; i < ncolumns; i++)
+		{
+			Form_pg_attribute att;
+			TypeCacheEntry *typentry;
+			uint32		element_hash;
+
+			att = TupleDescAttr(tupdesc, i);
+
+			if (att->attisdropped)
+				continue;
+
+			/*
+			 * Lookup the hash function if not done already
+			 */
+			typentry = my_extra[i];
+			if (typentry == NULL ||
+				typentry->type_id != att->atttypid)
+			{
+				typentry = lookup_type_cache(att->atttypid,
+											 TYPECACHE_HASH_EXTENDED_PROC_FINFO);
+				if (!OidIsValid(typentry->hash_extended_proc_finfo.fn_oid))
+					ereport(ERROR,
+							(errcode(ERRCODE_UNDEFINED_FUNCTION),
+							 errmsg("could not identify an extended hash function for type %s",
+									format_type_be(typentry->type_id))));
+				my_extra[i] = typentry;
+			}
+
+			/* Compute hash of element */
+			if (nulls[i])
+			{
+				// FIXME handle NULL
+				element_hash = 0;
+			}
+			else
+			{
+				LOCAL_FCINFO(locfcinfo, 2);
+
+				InitFunctionCallInfoData(*locfcinfo, &typentry->hash_extended_proc_finfo, 2,
+										 att->attcollation, NULL, NULL);
+				locfcinfo->args[0].value = values[i];
+				locfcinfo->args[0].isnull = false;
+				locfcinfo->args[1].value = Int64GetDatum(0);
+				locfcinfo->args[0].isnull = false;
+				element_hash = DatumGetUInt64(FunctionCallInvoke(locfcinfo));
+
+				/* We don't expect hash support functions to return null */
+				Assert(!locfcinfo->isnull);
+			}
+
+			if (esketch->sparse != NULL)
+				omnisketch_sparse_add_hash(esketch->sparse, i, element_hash, id);
+			else
+				omnisketch_add_hash(sketch, i, element_hash, id);
+		}
+	}
+
+	array_free_iterator(iter);
+
+	if (values != NULL)
+	{
+		pfree(values);
+		pfree(nulls);
+	}
+
+	if (tupdesc != NULL)
+		ReleaseTupleDesc(tupdesc);
+
+	/* the batch may have been empty, just return the current state */
+	if (esketch == NULL)
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	if (esketch->sparse != NULL)
+		AssertCheckSparse(esketch->sparse);
+	else
+		AssertCheckSketch(sketch);
+
+	PG_RETURN_DATUM(EOHPGetRWDatum(&esketch->hdr));
+}
+
+/*
+ * Map a range-attribute value into the dyadic domain of the sketch. The
+ * values have to be non-negative and fit into rangeBits bits - that's the
+ * domain covered by the hierarchy of prefixes.
+ */
+static uint32
+omnisketch_range_value(int32 value, int rangeBits)
+{
+	if ((value < 0) ||
+		((rangeBits < 32) && ((int64) value >= ((int64) 1 << rangeBits))))
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("value %d is out of range for a sketch with %d dyadic levels",
+						value, rangeBits)));
+
+	return (uint32) value;
+}
+
+/*
+ * Add a value to a range sketch - one with a hierarchy of dyadic levels
+ * built on the first attribute of the record, so that ranges on that
+ * attribute can be estimated by summing O(log n) per-node estimates (see
+ * omnisketch_estimate_range). The remaining attributes are regular
+ * equality attributes, handled exactly like in omnisketch_add.
+ */
+Datum
+omnisketch_add_range(PG_FUNCTION_ARGS)
+{
+	omnisketch_expanded_t *esketch;
+	omnisketch_t   *sketch = NULL;
+	MemoryContext	aggcontext;
+	uint32			id;
+	int				rangeBits = PG_GETARG_INT32(3);
+	HeapTupleHeader	record = PG_GETARG_HEAPTUPLEHEADER(4);
+	omnisketch_scratch_t *scratch;
+	int				ncolumns;
+	int				nsketches;
+	uint32			rangeValue;
+
+	if ((rangeBits < 1) || (rangeBits > 32))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of dyadic levels must be between 1 and 32")));
+
+	scratch = omnisketch_scratch_init(fcinfo, record);
+	ncolumns = scratch->ncolumns;
+
+	/* one sub-sketch per dyadic level, plus the equality attributes */
+	nsketches = rangeBits + (ncolumns - 1);
+
+	/*
+	 * Make sure to have an expanded sketch, so that we can update it in
+	 * place. When not in an aggregate (e.g. when called directly), just
+	 * parent it to the current memory context - the result gets flattened
+	 * when stored, like any other expanded object.
+	 */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		aggcontext = CurrentMemoryContext;
+
+	if (PG_ARGISNULL(0))
+		esketch = omnisketch_expand(NULL, aggcontext);
+	else
+		esketch = omnisketch_get_expanded(PG_GETARG_DATUM(0), aggcontext);
+
+	/* make sure to have a sketch (new ones start sparse) */
+	if ((esketch->sketch == NULL) && (esketch->sparse == NULL))
+	{
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(esketch->hdr.eoh_context);
+		esketch->sparse = omnisketch_sparse_create(nsketches,
+												   PG_GETARG_FLOAT8(1),
+												   PG_GETARG_FLOAT8(2),
+												   0, false);
+
+		/* remember the number of dyadic levels */
+		esketch->sparse->hdr.flags |= (rangeBits << 16);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	sketch = (esketch->sparse != NULL) ? &esketch->sparse->hdr : esketch->sketch;
+
+	Assert(sketch != NULL);
+
+	if (SKETCH_RANGE_BITS(sketch) != rangeBits)
+		elog(ERROR, "number of dyadic levels mismatches sketch (%d != %d)",
+			 rangeBits, SKETCH_RANGE_BITS(sketch));
+
+	if (sketch->numSketches != nsketches)
+		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+			 ncolumns, (sketch->numSketches - rangeBits + 1));
+
+	/* generate ID for the record (also counts the record as added) */
+	id = omnisketch_next_id(sketch);
+
+	/* Break down the tuple into fields */
+	omnisketch_scratch_deform(scratch, record);
+
+	/*
+	 * The range attribute. Unlike the equality attributes we need the
+	 * actual value (to build the dyadic prefixes), not just a hash, so
+	 * the attribute has to be an integer within the dyadic domain.
+	 */
+	if (TupleDescAttr(scratch->tupdesc, 0)->atttypid != INT4OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("range attribute must be of type integer")));
+
+	if (scratch->nulls[0])
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("range attribute must not be NULL")));
+
+	rangeValue = omnisketch_range_value(DatumGetInt32(scratch->values[0]),
+										rangeBits);
+
+	/* add the prefix of the value to the sub-sketch for each level */
+	for (int l = 0; l < rangeBits; l++)
+	{
+		uint32	prefix = (rangeValue >> l);
+		uint32	h = SKETCH_HASH(prefix, l);
+
+		if (esketch->sparse != NULL)
+			omnisketch_sparse_add_hash(esketch->sparse, l, h, id);
+		else
+			omnisketch_add_hash(sketch, l, h, id);
+	}
+
+	for (int i = 1; i < ncolumns; i++)
+	{
+		uint32		element_hash;
+
+		/* dropped column */
+		if (scratch->hashfcinfo[i] == NULL)
+			continue;
+
+		element_hash = omnisketch_scratch_hash(scratch, i);
+
+		if (esketch->sparse != NULL)
+			omnisketch_sparse_add_hash(esketch->sparse, rangeBits + (i - 1),
+									   element_hash, id);
+		else
+			omnisketch_add_hash(sketch, rangeBits + (i - 1), element_hash, id);
+	}
+
+	if (esketch->sparse != NULL)
+		AssertCheckSparse(esketch->sparse);
+	else
+		AssertCheckSketch(sketch);
+
+	PG_RETURN_DATUM(EOHPGetRWDatum(&esketch->hdr));
+}
+
+/*
+ * Transition function of the windowed aggregate - add a record labeled with
+ * an epoch to a sliding-window sketch keeping the last "nepochs" epochs (see
+ * OMNISKETCH_FLAG_WINDOW). The epoch labels may arrive in any order - a
+ * label newer than the current epoch advances the window (retiring the
+ * expired slots), a label that already fell out of the window is discarded,
+ * anything else goes to the slot of its epoch.
+ */
+Datum
+omnisketch_add_window(PG_FUNCTION_ARGS)
+{
+	omnisketch_expanded_t *esketch;
+	omnisketch_t   *sketch = NULL;
+	MemoryContext	aggcontext;
+	uint32			id;
+	int				nepochs = PG_GETARG_INT32(3);
+	int				epoch = PG_GETARG_INT32(4);
+	HeapTupleHeader	record = PG_GETARG_HEAPTUPLEHEADER(5);
+	omnisketch_window_t *window;
+	int				slot;
+	omnisketch_scratch_t *scratch;
+	int				ncolumns;
+
+	if (nepochs < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of epochs must be a positive integer")));
+
+	if (epoch < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("epoch must be a non-negative integer")));
+
+	scratch = omnisketch_scratch_init(fcinfo, record);
+	ncolumns = scratch->ncolumns;
+
+	/*
+	 * Make sure to have an expanded sketch, so that we can update it in
+	 * place. When not in an aggregate (e.g. when called directly), just
+	 * parent it to the current memory context - the result gets flattened
+	 * when stored, like any other expanded object.
+	 */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		aggcontext = CurrentMemoryContext;
+
+	if (PG_ARGISNULL(0))
+		esketch = omnisketch_expand(NULL, aggcontext);
+	else
+		esketch = omnisketch_get_expanded(PG_GETARG_DATUM(0), aggcontext);
+
+	/*
+	 * Make sure to have a sketch. Unlike the other aggregates the windowed
+	 * state is created flat right away - the ring keeps recycling its slots
+	 * no matter how small the group is, and the sparse form has no place
+	 * for the window descriptor.
+	 */
+	if ((esketch->sketch == NULL) && (esketch->sparse == NULL))
+	{
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(esketch->hdr.eoh_context);
+		esketch->sketch = omnisketch_create_window(ncolumns,
+												   PG_GETARG_FLOAT8(1),
+												   PG_GETARG_FLOAT8(2),
+												   nepochs, epoch);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	if ((esketch->sparse != NULL) || !SKETCH_HAS_WINDOW(esketch->sketch))
+		elog(ERROR, "sketch was not built by the omnisketch_window aggregate");
+
+	sketch = esketch->sketch;
+
+	window = SKETCH_WINDOW(sketch);
+
+	if (window->nepochs != nepochs)
+		elog(ERROR, "number of epochs mismatches sketch (%d != %d)",
+			 nepochs, window->nepochs);
+
+	if (sketch->numSketches != ncolumns * nepochs)
+		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+			 ncolumns, (sketch->numSketches / nepochs));
+
+	/* a newer label advances the window, retiring the expired epochs */
+	if (epoch > window->epoch)
+		omnisketch_advance_sketch(sketch, epoch);
+
+	/* discard records that already fell out of the window */
+	if (epoch <= window->epoch - nepochs)
+		PG_RETURN_DATUM(EOHPGetRWDatum(&esketch->hdr));
+
+	slot = (int) ((uint32) epoch % nepochs);
+
+	/* generate ID for the record (also counts the record as added) */
+	id = omnisketch_next_id(sketch);
+
+	/* Break down the tuple into fields */
+	omnisketch_scratch_deform(scratch, record);
+
+	for (int i = 0; i < ncolumns; i++)
+	{
+		uint32		element_hash;
+
+		/* dropped column */
+		if (scratch->hashfcinfo[i] == NULL)
+			continue;
+
+		element_hash = omnisketch_scratch_hash(scratch, i);
+
+		/* add the value to the sub-sketch of the epoch's slot */
+		omnisketch_add_hash(sketch, slot * ncolumns + i, element_hash, id);
+	}
+
+	AssertCheckSketch(sketch);
+
+	PG_RETURN_DATUM(EOHPGetRWDatum(&esketch->hdr));
+}
+
+/*
+ * Advance a windowed sketch to the given epoch, retiring the epochs that
+ * fall out of the window - e.g. to expire the stale epochs of a stored
+ * sketch before estimating, without adding any new records.
+ */
+Datum
+omnisketch_advance(PG_FUNCTION_ARGS)
+{
+	omnisketch_t   *sketch = PG_GETARG_OMNISKETCH(0);
+	int				epoch = PG_GETARG_INT32(1);
+
+	if (!SKETCH_HAS_WINDOW(sketch))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("only sketches built by omnisketch_window can be advanced")));
+
+	if (epoch < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("epoch must be a non-negative integer")));
+
+	/* don't scribble over the (possibly not copied) input */
+	sketch = omnisketch_copy(sketch);
+
+	omnisketch_advance_sketch(sketch, epoch);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+/*
+ * Add a single record to a stored sketch, outside of any aggregate - e.g.
+ * from an UPDATE or a trigger. The record is appended directly into the
+ * buckets of (a copy of) the sketch, so folding in a trickle of late
+ * rows costs a handful of bucket updates per row, instead of building a
+ * full-size temporary sketch and merging it with omnisketch_combine.
+ *
+ * Sketches with stored hashes keep the samples sorted incrementally (see
+ * omnisketch_sample_add), so the result stays finalized. Old sketches
+ * without the hashes would lose the sample ordering, so those have to go
+ * through the aggregate-and-combine path and are rejected here.
+ */
+Datum
+omnisketch_add_record(PG_FUNCTION_ARGS)
+{
+	omnisketch_t   *sketch = PG_GETARG_OMNISKETCH(0);
+	HeapTupleHeader	record = PG_GETARG_HEAPTUPLEHEADER(1);
+	omnisketch_scratch_t *scratch;
+	int				ncolumns;
+	int				nattrs;
+	int				rangeBits = SKETCH_RANGE_BITS(sketch);
+	int				firstcol = 0;
+	int				offset = 0;
+	uint32			id;
+
+	AssertCheckSketch(sketch);
+
+	if (!SKETCH_HAS_HASHES(sketch))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot add records to a sketch without stored hashes")));
+
+	scratch = omnisketch_scratch_init(fcinfo, record);
+	ncolumns = scratch->ncolumns;
+
+	if (SKETCH_HAS_WINDOW(sketch))
+	{
+		omnisketch_window_t *window = SKETCH_WINDOW(sketch);
+
+		/* a windowed sketch keeps one sub-sketch per (epoch, attribute) */
+		nattrs = (sketch->numSketches / window->nepochs);
+
+		/* the record counts into the current epoch of the window */
+		offset = (int) ((uint32) window->epoch % window->nepochs) * nattrs;
+	}
+	else if (rangeBits > 0)
+	{
+		/* the first attribute maps to the rangeBits dyadic sub-sketches */
+		nattrs = (sketch->numSketches - rangeBits) + 1;
+		offset = rangeBits;
+		firstcol = 1;
+	}
+	else
+		nattrs = sketch->numSketches;
+
+	if (nattrs != ncolumns)
+		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+			 ncolumns, nattrs);
+
+	/* don't scribble over the (possibly not copied) input */
+	sketch = omnisketch_copy(sketch);
+
+	/* generate ID for the record (also counts the record as added) */
+	id = omnisketch_next_id(sketch);
+
+	/* Break down the tuple into fields */
+	omnisketch_scratch_deform(scratch, record);
+
+	/* the range attribute, with the same restrictions as omnisketch_range */
+	if (rangeBits > 0)
+	{
+		uint32		rangeValue;
+
+		if (TupleDescAttr(scratch->tupdesc, 0)->atttypid != INT4OID)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("range attribute must be of type integer")));
+
+		if (scratch->nulls[0])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("range attribute must not be NULL")));
+
+		rangeValue = omnisketch_range_value(DatumGetInt32(scratch->values[0]),
+											rangeBits);
+
+		/* add the prefix of the value to the sub-sketch for each level */
+		for (int l = 0; l < rangeBits; l++)
+		{
+			uint32	prefix = (rangeValue >> l);
+			uint32	h = SKETCH_HASH(prefix, l);
+
+			omnisketch_add_hash(sketch, l, h, id);
+		}
+	}
+
+	for (int i = firstcol; i < ncolumns; i++)
+	{
+		uint32		element_hash;
+
+		/* dropped column */
+		if (scratch->hashfcinfo[i] == NULL)
+			continue;
+
+		element_hash = omnisketch_scratch_hash(scratch, i);
+
+		omnisketch_add_hash(sketch, offset + (i - firstcol), element_hash, id);
+	}
+
+	AssertCheckSketch(sketch);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+/*
+ * compare (hash, item) lexicographically - first by hash, then by item
+ */
+static int
+cmp_item_hash(const void *a, const void *b)
+{
+	item_hash_t *ia = (item_hash_t *) a;
+	item_hash_t *ib = (item_hash_t *) b;
+
+	if (ia->hash < ib->hash)
+		return -1;
+	else if (ia->hash > ib->hash)
+		return 1;
+
+	if (ia->item < ib->item)
+		return -1;
+	else if (ia->item > ib->item)
+		return 1;
+
+	/* FIXME duplicate item IDs shouldn't really happen, right? */
+	return 0;
+}
+
+/*
+ * Fill "sorted" (a caller-provided array with room for sampleSize pairs)
+ * with the items sorted by hash. The elements are pairs (item,hash), so
+ * that the hash does not need to be recalculated - both for sorting, and
+ * later. With stored hashes (OMNISKETCH_FLAG_HASHES) the hashes are simply
+ * copied, otherwise we compute them.
+ *
+ * The buffer is provided by the caller so that loops over many buckets
+ * (sort, combine) can allocate it just once, instead of doing a palloc
+ * and pfree for every single bucket.
+ */
+static void
+omnisketch_sorted_items(omnisketch_t *sketch, bucket_t *bucket,
+						void *items, uint32 *hashes, item_hash_t *sorted)
+{
+	for (int k = 0; k < bucket->sampleCount; k++)
+	{
+		sorted[k].item = sketch_sample_get(sketch, items, k);
+		sorted[k].hash = sample_item_hash(sketch, items, hashes, k);
+	}
+
+	if (!bucket->isSorted)
+		pg_qsort(sorted, bucket->sampleCount, sizeof(item_hash_t), cmp_item_hash);
+}
+
+/*
+ * make sure samples for all buckets are sorted
+ */
+static void
+omnisketch_sort(omnisketch_t *sketch)
+{
+	/* scratch space for sorting, reused for all the buckets */
+	item_hash_t *items = palloc(sketch->sampleSize * sizeof(item_hash_t));
+
+	for (int i = 0; i < sketch->numSketches; i++)
+	{
+		for (int j = 0; j < sketch->sketchHeight; j++)
+		{
+			for (int k = 0; k < sketch->sketchWidth; k++)
+			{
+				bucket_t	bucket;
+				int			idx = SKETCH_BUCKET_INDEX(sketch, i, j, k);
+				void	   *sample = SKETCH_SAMPLE(sketch, i, j, k);
+				uint32	   *hashes = SKETCH_SAMPLE_HASHES(sketch, i, j, k);
+
+				sketch_bucket_load(sketch, idx, &bucket);
+
+				/* nothing to do if already sorted */
+				if (bucket.isSorted)
+					continue;
+
+				/*
+				 * sort the item lists, so that we can calculate intersection
+				 * more efficiently in _estimate
+				 *
+				 * Sketches with stored hashes keep the samples sorted
+				 * incrementally (see omnisketch_sample_add), so this only
+				 * ever does actual work for old sketches without them.
+				 */
+				if (bucket.sampleCount >= 2)
+				{
+					omnisketch_sorted_items(sketch, &bucket, sample, hashes, items);
+
+					for (int l = 0; l < bucket.sampleCount; l++)
+					{
+						sketch_sample_set(sketch, sample, l, items[l].item);
+
+						if (hashes != NULL)
+							hashes[l] = items[l].hash;
+					}
+
+					/* the largest hash is at the very end */
+					bucket.maxIndex = (bucket.sampleCount - 1);
+					bucket.isSorted = true;
+
+					sketch_bucket_store(sketch, idx, &bucket);
+
+					AssertCheckBucket(sketch, &bucket, sample, hashes);
+				}
+			}
+		}
+	}
+
+	pfree(items);
+
+	AssertCheckSketch(sketch);
+}
+
+Datum
+omnisketch_finalize(PG_FUNCTION_ARGS)
+{
+	omnisketch_t *sketch = PG_GETARG_OMNISKETCH(0);
+
+	omnisketch_sort(sketch);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+/*
+ * Varint encoding for the packed format - the usual base-128 scheme, with
+ * 7 bits of the value per byte and the high bit marking a continuation.
+ */
+static char *
+omnisketch_encode_varint(char *ptr, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		*ptr++ = (char) ((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+
+	*ptr++ = (char) value;
+
+	return ptr;
+}
+
+static const char *
+omnisketch_decode_varint(const char *ptr, uint64 *value)
+{
+	uint64		v = 0;
+	int			shift = 0;
+
+	while (((uint8) *ptr) & 0x80)
+	{
+		v |= (uint64) (((uint8) *ptr++) & 0x7F) << shift;
+		shift += 7;
+	}
+
+	v |= (uint64) ((uint8) *ptr++) << shift;
+
+	*value = v;
+
+	return ptr;
+}
+
+/*
+ * Bounds-checked variant of omnisketch_decode_varint, for data coming from
+ * the outside (see omnisketch_recv). Returns NULL if the varint would run
+ * past "end" or is overlong, instead of reading out of bounds.
+ */
+static const char *
+omnisketch_decode_varint_safe(const char *ptr, const char *end, uint64 *value)
+{
+	uint64		v = 0;
+	int			shift = 0;
+
+	while ((ptr < end) && (((uint8) *ptr) & 0x80))
+	{
+		if (shift > 56)
+			return NULL;
+
+		v |= (uint64) (((uint8) *ptr++) & 0x7F) << shift;
+		shift += 7;
+	}
+
+	if (ptr == end)
+		return NULL;
+
+	v |= (uint64) ((uint8) *ptr++) << shift;
+
+	*value = v;
+
+	return ptr;
+}
+
+/*
+ * Build the packed (compressed) copy of a sketch. The caller is expected
+ * to have sorted the samples (see omnisketch_sort) - estimates only work
+ * on sorted samples anyway, and it makes the format simpler (no need to
+ * keep maxIndex/isSorted, and maxHash is the hash of the last item).
+ *
+ * Each bucket is stored as varint totalCount + sampleCount, followed by
+ * the raw sampled items. That skips the unused part of the fixed-size
+ * sample arrays and the stored hashes (recomputed when unpacking), which
+ * is where almost all of the space goes.
+ */
+static omnisketch_t *
+omnisketch_pack_sketch(omnisketch_t *sketch)
+{
+	omnisketch_t   *packed;
+	Size			len;
+	char		   *ptr;
+	int				nbuckets = SKETCH_SIZE(sketch) * sketch->numSketches;
+
+	Assert(!SKETCH_IS_PACKED(sketch));
+
+	/* worst case - two full varints and all the items for every bucket */
+	len = SKETCH_HEADER_BYTES(sketch);
+	len += nbuckets * ((SKETCH_HAS_WIDE_COUNTS(sketch) ? 10 : 5) + 3);
+	for (int i = 0; i < nbuckets; i++)
+	{
+		bucket_t	bucket;
+
+		sketch_bucket_load(sketch, i, &bucket);
+
+		len += bucket.sampleCount * SKETCH_ITEM_BYTES(sketch);
+	}
+
+	packed = palloc(len);
+
+	/* copy the header, including the 64-bit count of wide sketches */
+	memcpy(packed, sketch, SKETCH_HEADER_BYTES(sketch));
+	packed->flags |= OMNISKETCH_FLAG_PACKED;
+
+	ptr = (char *) packed + SKETCH_HEADER_BYTES(packed);
+
+	for (int i = 0; i < nbuckets; i++)
+	{
+		bucket_t	bucket;
+		char	   *sample = SKETCH_SAMPLES(sketch) +
+			(i * sketch->sampleSize * SKETCH_ITEM_BYTES(sketch));
+
+		sketch_bucket_load(sketch, i, &bucket);
+
+		Assert((bucket.sampleCount < 2) || bucket.isSorted);
+
+		ptr = omnisketch_encode_varint(ptr, bucket.totalCount);
+		ptr = omnisketch_encode_varint(ptr, bucket.sampleCount);
+
+		memcpy(ptr, sample, bucket.sampleCount * SKETCH_ITEM_BYTES(sketch));
+		ptr += bucket.sampleCount * SKETCH_ITEM_BYTES(sketch);
+	}
+
+	Assert((char *) packed + len >= ptr);
+
+	SET_VARSIZE(packed, ptr - (char *) packed);
+
+	return packed;
+}
+
+/*
+ * Expand a packed sketch back into the regular in-memory layout (with full
+ * sample arrays and stored hashes).
+ */
+static omnisketch_t *
+omnisketch_unpack_sketch(omnisketch_t *packed)
+{
+	omnisketch_t   *sketch;
+	const char	   *ptr;
+	int				nbuckets;
+
+	Assert(SKETCH_IS_PACKED(packed));
+
+	sketch = omnisketch_allocate(packed->numSketches,
+								 packed->sketchWidth,
+								 packed->sketchHeight,
+								 packed->sampleSize,
+								 packed->itemSize,
+								 SKETCH_HAS_NARROW_ITEMS(packed),
+								 SKETCH_HAS_WIDE_COUNTS(packed),
+								 SKETCH_HAS_WINDOW(packed) ?
+								 SKETCH_WINDOW(packed)->nepochs : 0);
+
+	/* keep the dyadic levels of the source (allocate starts with 0) */
+	sketch->flags |= (packed->flags & SKETCH_RANGE_BITS_MASK);
+
+	/*
+	 * Keep the bucket-addressing scheme of the source too - allocate flags
+	 * the sketch as double-hash, but legacy sketches were ingested with the
+	 * per-row hash chain and their buckets only hold data at those probed
+	 * positions. Unlike HASHES/SOA (layout of this in-memory copy) the
+	 * hashing scheme is semantic, so mirror it from the source.
+	 */
+	if (!SKETCH_HAS_DOUBLE_HASH(packed))
+		sketch->flags &= ~OMNISKETCH_FLAG_DOUBLE_HASH;
+
+	/* and the ring descriptor of windowed sketches */
+	if (SKETCH_HAS_WINDOW(packed))
+		SKETCH_WINDOW(sketch)->epoch = SKETCH_WINDOW(packed)->epoch;
+
+	if (SKETCH_HAS_WIDE_COUNTS(packed))
+		SKETCH_COUNT64(sketch) = SKETCH_COUNT64(packed);
+	else
+		sketch->count = packed->count;
+	sketch->seed = packed->seed;
+
+	nbuckets = SKETCH_SIZE(sketch) * sketch->numSketches;
+
+	ptr = (char *) packed + SKETCH_HEADER_BYTES(packed);
+
+	for (int i = 0; i < nbuckets; i++)
+	{
+		bucket_t	bucket;
+		char	   *sample = SKETCH_SAMPLES(sketch) +
+			(i * sketch->sampleSize * SKETCH_ITEM_BYTES(sketch));
+		uint32	   *hashes = &SKETCH_HASHES(sketch)[i * sketch->sampleSize];
+		uint64		value;
+
+		memset(&bucket, 0, sizeof(bucket_t));
+
+		ptr = omnisketch_decode_varint(ptr, &value);
+		bucket.totalCount = value;
+
+		ptr = omnisketch_decode_varint(ptr, &value);
+		bucket.sampleCount = (uint16) value;
+
+		memcpy(sample, ptr, bucket.sampleCount * SKETCH_ITEM_BYTES(sketch));
+		ptr += bucket.sampleCount * SKETCH_ITEM_BYTES(sketch);
+
+		for (int k = 0; k < bucket.sampleCount; k++)
+		{
+			int32	item = sketch_sample_get(sketch, sample, k);
+
+			hashes[k] = SKETCH_HASH(item, SKETCH_SEED);
+		}
+
+		if (bucket.sampleCount > 0)
+		{
+			/* the samples were packed in sorted order, max hash is last */
+			bucket.isSorted = true;
+			bucket.maxIndex = (bucket.sampleCount - 1);
+			bucket.maxHash = hashes[bucket.sampleCount - 1];
+		}
+
+		sketch_bucket_store(sketch, i, &bucket);
+
+		AssertCheckBucket(sketch, &bucket, sample, hashes);
+	}
+
+	Assert(ptr == (char *) packed + VARSIZE(packed));
+
+	AssertCheckSketch(sketch);
+
+	return sketch;
+}
+
+/* pack the sketch into the compressed format (e.g. before storing it) */
+Datum
+omnisketch_pack(PG_FUNCTION_ARGS)
+{
+	omnisketch_t *sketch
+		= (omnisketch_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+	/* already packed, just return it */
+	if (SKETCH_IS_PACKED(sketch))
+		PG_RETURN_POINTER(sketch);
+
+	/* don't scribble over the (possibly not copied) input */
+	sketch = omnisketch_copy(sketch);
+	omnisketch_sort(sketch);
+
+	PG_RETURN_POINTER(omnisketch_pack_sketch(sketch));
+}
+
+/* expand a packed sketch back into the regular format */
+Datum
+omnisketch_unpack(PG_FUNCTION_ARGS)
+{
+	/* the detoast takes care of unpacking */
+	PG_RETURN_POINTER(PG_GETARG_OMNISKETCH(0));
+}
+
+/* compare sketch parameters, make sure it's the same / compatible */
+static bool
+omnisketch_equals(omnisketch_t *a, omnisketch_t *b)
+{
+	/*
+	 * Sketches with narrow items can't be merged with the old 32-bit ones,
+	 * even with the same itemSize - the old IDs use the full 32 bits and
+	 * would not fit into the narrow slots. Similarly for the counter width
+	 * - merging a wide-counter sketch into regular 32-bit counters could
+	 * silently overflow them. The bucket-selection scheme has to match
+	 * too, otherwise the same value lands in different buckets. Windowed
+	 * sketches need the same ring length (the current epochs may differ,
+	 * the merge aligns them first).
+	 */
+	return ((a->numSketches == b->numSketches) &&
+			(a->sketchHeight == b->sketchHeight) &&
+			(a->sketchWidth == b->sketchWidth) &&
+			(a->sampleSize == b->sampleSize) &&
+			(a->itemSize == b->itemSize) &&
+			(SKETCH_HAS_NARROW_ITEMS(a) == SKETCH_HAS_NARROW_ITEMS(b)) &&
+			(SKETCH_HAS_WIDE_COUNTS(a) == SKETCH_HAS_WIDE_COUNTS(b)) &&
+			(SKETCH_HAS_DOUBLE_HASH(a) == SKETCH_HAS_DOUBLE_HASH(b)) &&
+			(SKETCH_HAS_WINDOW(a) == SKETCH_HAS_WINDOW(b)) &&
+			(!SKETCH_HAS_WINDOW(a) ||
+			 (SKETCH_WINDOW(a)->nepochs == SKETCH_WINDOW(b)->nepochs)) &&
+			(SKETCH_RANGE_BITS(a) == SKETCH_RANGE_BITS(b)));
+}
+
+/*
+ * merge two buckets, the first bucket is updated
+ *
+ * dst_items/src_items are scratch buffers with room for sampleSize pairs
+ * each, allocated once by the caller and reused for every bucket.
+ */
+static void
+omnisketch_merge_buckets(omnisketch_t *dst, omnisketch_t *src,
+						 bucket_t *dst_bucket, bucket_t *src_bucket,
+						 void *dst_sample, void *src_sample,
+						 uint32 *dst_hashes, uint32 *src_hashes,
+						 int sampleSize,
+						 item_hash_t *dst_items, item_hash_t *src_items)
 {
 	int			i,
 				j,
 				k;
-	item_hash_t *dst_items;
-	item_hash_t *src_items;
 
-	AssertCheckBucket(dst, dst_bucket, dst_sample);
-	AssertCheckBucket(src, src_bucket, src_sample);
+	AssertCheckBucket(dst, dst_bucket, dst_sample, dst_hashes);
+	AssertCheckBucket(src, src_bucket, src_sample, src_hashes);
+
+	/* nothing to do if the second bucket is empty */
+	if (src_bucket->sampleCount == 0)
+		return;
+
+	omnisketch_sorted_items(dst, dst_bucket, dst_sample, dst_hashes, dst_items);
+	omnisketch_sorted_items(src, src_bucket, src_sample, src_hashes, src_items);
+
+	i = j = k = 0;
+	while ((k < sampleSize) &&
+		   (i < dst_bucket->sampleCount || j < src_bucket->sampleCount))
+	{
+		item_hash_t *item;
+
+		if (i == dst_bucket->sampleCount)
+			item = &src_items[j++];
+		else if (j == src_bucket->sampleCount)
+			item = &dst_items[i++];
+		else if (cmp_item_hash(&dst_items[i], &src_items[j]) > 0)
+			item = &src_items[j++];
+		else
+		{
+			/* FIXME shouldn't really happen, I think, or maybe advance both? */
+			Assert(cmp_item_hash(&dst_items[i], &src_items[j]) != 0);
+
+			item = &dst_items[i++];
+		}
+
+		sketch_sample_set(dst, dst_sample, k, item->item);
+
+		if (dst_hashes != NULL)
+			dst_hashes[k] = item->hash;
+
+		dst_bucket->maxHash = item->hash;
+		k++;
+	}
+
+	Assert(k >= Max(dst_bucket->sampleCount, src_bucket->sampleCount));
+
+	dst_bucket->totalCount += src_bucket->totalCount;
+	dst_bucket->isSorted = true;
+	dst_bucket->sampleCount = k;
+	dst_bucket->maxIndex = (dst_bucket->sampleCount - 1);
+
+	AssertCheckBucket(dst, dst_bucket, dst_sample, dst_hashes);
+}
+
+/*
+ * Combine two sketches, the first sketch is updated with the result and then
+ * returned (if NULL, a new sketch is allocated). Used as combine function for
+ * parallel aggregates.
+ */
+Datum
+omnisketch_combine(PG_FUNCTION_ARGS)
+{
+	omnisketch_expanded_t *esketch;
+	omnisketch_t	 *src;
+	omnisketch_t	 *dst;
+	MemoryContext aggcontext;
+	item_hash_t	 *dst_items;
+	item_hash_t	 *src_items;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "omnisketch_combine called in non-aggregate context");
+
+	/* if no "merged" state yet, try creating it */
+	if (PG_ARGISNULL(0))
+	{
+		/* nope, the second argument is NULL to, so return NULL */
+		if (PG_ARGISNULL(1))
+			PG_RETURN_NULL();
+
+		/* the second argument is not NULL, so copy it */
+		src = (omnisketch_t *) PG_GETARG_OMNISKETCH(1);
+
+		/* expand the sketch, so that later calls can update it in place */
+		esketch = omnisketch_expand(src, aggcontext);
+
+		PG_RETURN_DATUM(EOHPGetRWDatum(&esketch->hdr));
+	}
+
+	/*
+	 * If the second argument is NULL, just return the first one (we know
+	 * it's not NULL at this point).
+	 */
+	if (PG_ARGISNULL(1))
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+	/* Now we know neither argument is NULL, so merge them. */
+	esketch = omnisketch_get_expanded(PG_GETARG_DATUM(0), aggcontext);
+
+	/*
+	 * The merge works on the dense layout, so if the state is still sparse
+	 * (built by the transition function), flatten it first - the merged
+	 * result fills the buckets anyway, so there's little to save by staying
+	 * sparse.
+	 */
+	if (esketch->sparse != NULL)
+	{
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(esketch->hdr.eoh_context);
+		esketch->sketch = omnisketch_sparse_flatten(esketch->sparse);
+		MemoryContextSwitchTo(oldcontext);
+
+		omnisketch_sparse_free(esketch->sparse);
+		esketch->sparse = NULL;
+	}
+
+	dst = esketch->sketch;
+	src = (omnisketch_t *) PG_GETARG_OMNISKETCH(1);
+
+	AssertCheckSketch(dst);
+	AssertCheckSketch(src);
+
+	if (!omnisketch_equals(src, dst))
+		elog(ERROR, "sketches do not match");
+
+	/*
+	 * The slots of windowed sketches can only be merged when they hold the
+	 * same epoch labels, so advance the older sketch to the newer epoch
+	 * first (retiring the epochs not live in both) - then the slots line
+	 * up and the regular positional merge below just works.
+	 */
+	if (SKETCH_HAS_WINDOW(dst))
+	{
+		if (SKETCH_WINDOW(dst)->epoch < SKETCH_WINDOW(src)->epoch)
+			omnisketch_advance_sketch(dst, SKETCH_WINDOW(src)->epoch);
+		else if (SKETCH_WINDOW(src)->epoch < SKETCH_WINDOW(dst)->epoch)
+		{
+			/* don't scribble over the (possibly not copied) input */
+			src = omnisketch_copy(src);
+			omnisketch_advance_sketch(src, SKETCH_WINDOW(dst)->epoch);
+		}
+	}
+
+	/* scratch space for the merges, reused for all the buckets */
+	dst_items = palloc(dst->sampleSize * sizeof(item_hash_t));
+	src_items = palloc(src->sampleSize * sizeof(item_hash_t));
+
+	for (int a = 0; a < src->numSketches; a++)
+	{
+		for (int i = 0; i < src->sketchHeight; i++)
+		{
+			for (int j = 0; j < src->sketchWidth; j++)
+			{
+				bucket_t	dst_bucket;
+				bucket_t	src_bucket;
+
+				int		dst_idx = SKETCH_BUCKET_INDEX(dst, a, i, j);
+				int		src_idx = SKETCH_BUCKET_INDEX(src, a, i, j);
+
+				void *dst_sample = SKETCH_SAMPLE(dst, a, i, j);
+				void *src_sample = SKETCH_SAMPLE(src, a, i, j);
+
+				uint32 *dst_hashes = SKETCH_SAMPLE_HASHES(dst, a, i, j);
+				uint32 *src_hashes = SKETCH_SAMPLE_HASHES(src, a, i, j);
+
+				sketch_bucket_load(dst, dst_idx, &dst_bucket);
+				sketch_bucket_load(src, src_idx, &src_bucket);
+
+				omnisketch_merge_buckets(dst, src,
+										 &dst_bucket, &src_bucket,
+										 dst_sample, src_sample,
+										 dst_hashes, src_hashes,
+										 dst->sampleSize,
+										 dst_items, src_items);
+
+				sketch_bucket_store(dst, dst_idx, &dst_bucket);
+
+				AssertCheckBucket(dst, &dst_bucket, dst_sample, dst_hashes);
+				AssertCheckBucket(src, &src_bucket, src_sample, src_hashes);
+			}
+		}
+	}
+
+	pfree(dst_items);
+	pfree(src_items);
+
+	sketch_add_count(dst, sketch_get_count(src));
+
+	AssertCheckSketch(dst);
+
+	PG_RETURN_DATUM(EOHPGetRWDatum(&esketch->hdr));
+}
+
+/*
+ * Transition state of the omnisketch(sketch) rollup aggregate. Merging
+ * each input into the accumulated result right away (pairwise, through
+ * omnisketch_combine) re-materializes every destination bucket sample once
+ * per input, so rolling up N sketches costs N passes per bucket. Instead,
+ * collect copies of the input sketches and merge them in batches with a
+ * single k-way heap merge per bucket - one pass emitting sampleSize items
+ * with log2(k) comparisons each.
+ *
+ * The collection is capped to bound the memory usage - when the array
+ * fills up, it is folded into a single merged sketch and the collection
+ * starts over, so a rollup of N sketches does N/64 folds instead of N
+ * pairwise bucket merges.
+ */
+#define OMNISKETCH_MERGE_MAX_SKETCHES	64
+
+typedef struct omnisketch_merge_state_t
+{
+	MemoryContext	cxt;		/* context the collected sketches live in */
+	int				nsketches;	/* number of collected sketches */
+	omnisketch_t   *sketches[OMNISKETCH_MERGE_MAX_SKETCHES];
+} omnisketch_merge_state_t;
+
+/* one sorted run (the sample of one input bucket) in the k-way merge */
+typedef struct merge_run_t
+{
+	item_hash_t	   *items;		/* the materialized sorted sample */
+	int				nitems;		/* number of items in the run */
+	int				next;		/* position of the run head */
+} merge_run_t;
+
+/*
+ * Restore the min-heap property for the run at position "i" of the heap
+ * (the heap orders the runs by their head item, using the same ordering
+ * as the pairwise merge).
+ */
+static void
+merge_heap_sift(merge_run_t *runs, int *heap, int nheap, int i)
+{
+	while (true)
+	{
+		int		l = 2 * i + 1;
+		int		r = 2 * i + 2;
+		int		s = i;
+		int		tmp;
+
+		if ((l < nheap) &&
+			(cmp_item_hash(&runs[heap[l]].items[runs[heap[l]].next],
+						   &runs[heap[s]].items[runs[heap[s]].next]) < 0))
+			s = l;
+
+		if ((r < nheap) &&
+			(cmp_item_hash(&runs[heap[r]].items[runs[heap[r]].next],
+						   &runs[heap[s]].items[runs[heap[s]].next]) < 0))
+			s = r;
+
+		if (s == i)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[s];
+		heap[s] = tmp;
+
+		i = s;
+	}
+}
+
+/*
+ * Merge a batch of matching sketches into a new sketch (allocated in the
+ * current memory context), with one k-way heap merge per bucket. Each
+ * non-empty input bucket contributes one sorted run, and the merge emits
+ * items in hash order until the sample is full - the bounded samples keep
+ * the smallest hashes, so the rest of the heap never needs draining.
+ * Windowed sketches are advanced to the newest epoch first, so the slots
+ * line up (this modifies the inputs, which the merge state owns).
+ */
+static omnisketch_t *
+omnisketch_merge_sketches(omnisketch_t **sketches, int nsketches)
+{
+	omnisketch_t   *dst;
+	merge_run_t	   *runs;
+	item_hash_t	   *items;
+	int			   *heap;
+
+	Assert(nsketches > 0);
+
+	for (int s = 1; s < nsketches; s++)
+	{
+		if (!omnisketch_equals(sketches[0], sketches[s]))
+			elog(ERROR, "sketches do not match");
+	}
+
+	/* align the epochs of windowed sketches (see omnisketch_combine) */
+	if (SKETCH_HAS_WINDOW(sketches[0]))
+	{
+		int		epoch = SKETCH_WINDOW(sketches[0])->epoch;
+
+		for (int s = 1; s < nsketches; s++)
+			epoch = Max(epoch, SKETCH_WINDOW(sketches[s])->epoch);
+
+		for (int s = 0; s < nsketches; s++)
+		{
+			if (SKETCH_WINDOW(sketches[s])->epoch < epoch)
+				omnisketch_advance_sketch(sketches[s], epoch);
+		}
+	}
+
+	dst = omnisketch_copy(sketches[0]);
+
+	if (nsketches == 1)
+		return dst;
+
+	/* the record count first, the bucket asserts compare against it */
+	for (int s = 1; s < nsketches; s++)
+		sketch_add_count(dst, sketch_get_count(sketches[s]));
+
+	/* scratch space, reused for all the buckets */
+	items = palloc((Size) nsketches * dst->sampleSize * sizeof(item_hash_t));
+	runs = palloc(nsketches * sizeof(merge_run_t));
+	heap = palloc(nsketches * sizeof(int));
+
+	for (int a = 0; a < dst->numSketches; a++)
+	{
+		for (int i = 0; i < dst->sketchHeight; i++)
+		{
+			for (int j = 0; j < dst->sketchWidth; j++)
+			{
+				int			nruns = 0;
+				int			nheap;
+				int			k = 0;
+				uint64		totalCount = 0;
+
+				bucket_t	dst_bucket;
+				int			dst_idx = SKETCH_BUCKET_INDEX(dst, a, i, j);
+				void	   *dst_sample = SKETCH_SAMPLE(dst, a, i, j);
+				uint32	   *dst_hashes = SKETCH_SAMPLE_HASHES(dst, a, i, j);
+
+				/* materialize the non-empty samples as sorted runs */
+				for (int s = 0; s < nsketches; s++)
+				{
+					omnisketch_t   *src = sketches[s];
+					bucket_t		bucket;
+					void		   *sample = SKETCH_SAMPLE(src, a, i, j);
+					uint32		   *hashes = SKETCH_SAMPLE_HASHES(src, a, i, j);
+
+					sketch_bucket_load(src, SKETCH_BUCKET_INDEX(src, a, i, j),
+									   &bucket);
+
+					totalCount += bucket.totalCount;
+
+					if (bucket.sampleCount == 0)
+						continue;
+
+					runs[nruns].items = &items[nruns * dst->sampleSize];
+					runs[nruns].nitems = bucket.sampleCount;
+					runs[nruns].next = 0;
+
+					omnisketch_sorted_items(src, &bucket, sample, hashes,
+											runs[nruns].items);
+
+					nruns++;
+				}
+
+				/* the copied bucket is already the merge of nothing */
+				if (nruns == 0)
+					continue;
+
+				sketch_bucket_load(dst, dst_idx, &dst_bucket);
+
+				nheap = nruns;
+				for (int s = 0; s < nheap; s++)
+					heap[s] = s;
+				for (int s = nheap / 2 - 1; s >= 0; s--)
+					merge_heap_sift(runs, heap, nheap, s);
+
+				while ((nheap > 0) && (k < dst->sampleSize))
+				{
+					merge_run_t    *run = &runs[heap[0]];
+					item_hash_t    *item = &run->items[run->next++];
+
+					sketch_sample_set(dst, dst_sample, k, item->item);
+
+					if (dst_hashes != NULL)
+						dst_hashes[k] = item->hash;
+
+					dst_bucket.maxHash = item->hash;
+					k++;
+
+					if (run->next == run->nitems)
+						heap[0] = heap[--nheap];
+
+					merge_heap_sift(runs, heap, nheap, 0);
+				}
+
+				dst_bucket.totalCount = totalCount;
+				dst_bucket.sampleCount = k;
+				dst_bucket.maxIndex = (k - 1);
+				dst_bucket.isSorted = true;
+
+				sketch_bucket_store(dst, dst_idx, &dst_bucket);
+
+				AssertCheckBucket(dst, &dst_bucket, dst_sample, dst_hashes);
+			}
+		}
+	}
+
+	pfree(items);
+	pfree(runs);
+	pfree(heap);
+
+	AssertCheckSketch(dst);
+
+	return dst;
+}
+
+static omnisketch_merge_state_t *
+omnisketch_merge_state_create(MemoryContext cxt)
+{
+	omnisketch_merge_state_t *state;
+
+	state = MemoryContextAllocZero(cxt, sizeof(omnisketch_merge_state_t));
+	state->cxt = cxt;
+
+	return state;
+}
+
+/*
+ * Fold the collected sketches into a single merged one, freeing the
+ * originals - called when the collection fills up (to bound the memory
+ * usage) and before the state is serialized.
+ */
+static void
+omnisketch_merge_state_fold(omnisketch_merge_state_t *state)
+{
+	omnisketch_t   *merged;
+	MemoryContext	oldcontext;
+
+	Assert(state->nsketches > 0);
+
+	if (state->nsketches == 1)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(state->cxt);
+	merged = omnisketch_merge_sketches(state->sketches, state->nsketches);
+	MemoryContextSwitchTo(oldcontext);
+
+	for (int s = 0; s < state->nsketches; s++)
+		pfree(state->sketches[s]);
+
+	state->sketches[0] = merged;
+	state->nsketches = 1;
+}
+
+static void
+omnisketch_merge_state_add(omnisketch_merge_state_t *state,
+						   omnisketch_t *sketch)
+{
+	MemoryContext	oldcontext;
+
+	if (state->nsketches == OMNISKETCH_MERGE_MAX_SKETCHES)
+		omnisketch_merge_state_fold(state);
+
+	oldcontext = MemoryContextSwitchTo(state->cxt);
+	state->sketches[state->nsketches++] = omnisketch_copy(sketch);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Transition function of the omnisketch(sketch) rollup aggregate - collect
+ * a copy of the input sketch, folding the collection into a single merged
+ * sketch whenever it fills up (see omnisketch_merge_state_t).
+ */
+Datum
+omnisketch_merge_accum(PG_FUNCTION_ARGS)
+{
+	omnisketch_merge_state_t *state;
+	MemoryContext	aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "omnisketch_merge_accum called in non-aggregate context");
+
+	state = PG_ARGISNULL(0) ? NULL :
+		(omnisketch_merge_state_t *) PG_GETARG_POINTER(0);
+
+	/* NULL inputs are skipped, like in the pairwise combine */
+	if (PG_ARGISNULL(1))
+	{
+		if (state == NULL)
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(state);
+	}
+
+	if (state == NULL)
+		state = omnisketch_merge_state_create(aggcontext);
+
+	omnisketch_merge_state_add(state, PG_GETARG_OMNISKETCH(1));
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Combine two rollup states (parallel aggregation) - append the sketches
+ * collected by the second state to the first one.
+ */
+Datum
+omnisketch_merge_combine(PG_FUNCTION_ARGS)
+{
+	omnisketch_merge_state_t *dst;
+	omnisketch_merge_state_t *src;
+	MemoryContext	aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "omnisketch_merge_combine called in non-aggregate context");
+
+	dst = PG_ARGISNULL(0) ? NULL :
+		(omnisketch_merge_state_t *) PG_GETARG_POINTER(0);
+	src = PG_ARGISNULL(1) ? NULL :
+		(omnisketch_merge_state_t *) PG_GETARG_POINTER(1);
+
+	if (src == NULL)
+	{
+		if (dst == NULL)
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(dst);
+	}
+
+	if (dst == NULL)
+		dst = omnisketch_merge_state_create(aggcontext);
+
+	for (int s = 0; s < src->nsketches; s++)
+		omnisketch_merge_state_add(dst, src->sketches[s]);
+
+	PG_RETURN_POINTER(dst);
+}
+
+/*
+ * Serialize the rollup state (parallel aggregation) - fold the collected
+ * sketches into one and transmit that as a flat sketch.
+ */
+Datum
+omnisketch_merge_serial(PG_FUNCTION_ARGS)
+{
+	omnisketch_merge_state_t *state =
+		(omnisketch_merge_state_t *) PG_GETARG_POINTER(0);
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "omnisketch_merge_serial called in non-aggregate context");
+
+	omnisketch_merge_state_fold(state);
+
+	PG_RETURN_BYTEA_P((bytea *) omnisketch_copy(state->sketches[0]));
+}
+
+Datum
+omnisketch_merge_deserial(PG_FUNCTION_ARGS)
+{
+	omnisketch_t   *sketch;
+	omnisketch_merge_state_t *state;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "omnisketch_merge_deserial called in non-aggregate context");
+
+	sketch = (omnisketch_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+	state = omnisketch_merge_state_create(CurrentMemoryContext);
+	omnisketch_merge_state_add(state, sketch);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Final function of the rollup aggregate - merge whatever is collected and
+ * return the result. The k-way merge emits the samples already sorted, so
+ * the sort pass only ever does work for old sketches without stored hashes
+ * (same as omnisketch_finalize).
+ */
+Datum
+omnisketch_merge_final(PG_FUNCTION_ARGS)
+{
+	omnisketch_merge_state_t *state;
+	omnisketch_t   *sketch;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "omnisketch_merge_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (omnisketch_merge_state_t *) PG_GETARG_POINTER(0);
+
+	sketch = omnisketch_merge_sketches(state->sketches, state->nsketches);
+
+	omnisketch_sort(sketch);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+Datum
+omnisketch_in(PG_FUNCTION_ARGS)
+{
+	/*
+	 * omnisketch stores the data in binary form and parsing text input is
+	 * not needed, so disallow this.
+	 */
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("cannot accept a value of type %s", "omnisketch")));
+
+	PG_RETURN_VOID();			/* keep compiler quiet */
+}
+
+Datum
+omnisketch_out(PG_FUNCTION_ARGS)
+{
+	return byteaout(fcinfo);
+}
+
+/*
+ * Rebuild a sketch from the binary format produced by omnisketch_send,
+ * i.e. the packed representation without the varlena header. The data
+ * comes from outside the database, so unlike the regular detoast path we
+ * can't trust it - validate the header fields and walk all the packed
+ * buckets (with bounds-checked varint decoding) before accepting it. The
+ * item sort order is not verified here - that would mean rehashing every
+ * sampled item - but an unsorted sample can only skew estimates, not
+ * crash, and the debug builds still catch it when unpacking.
+ */
+Datum
+omnisketch_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo		buf = (StringInfo) PG_GETARG_POINTER(0);
+	omnisketch_t   *sketch;
+	int				nbytes = buf->len - buf->cursor;
+	int				nbuckets;
+	const char	   *ptr;
+	const char	   *end;
+	uint64			rowCount = 0;
+	uint64		   *windowRowCounts = NULL;
+
+	if (nbytes < MAXALIGN(sizeof(omnisketch_t)) - VARHDRSZ)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: message too short")));
+
+	sketch = palloc(VARHDRSZ + nbytes);
+	SET_VARSIZE(sketch, VARHDRSZ + nbytes);
+	memcpy(VARDATA(sketch), pq_getmsgbytes(buf, nbytes), nbytes);
+	pq_getmsgend(buf);
+
+	if (!SKETCH_IS_PACKED(sketch))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: not in the packed format")));
+
+	if (sketch->flags & ~(OMNISKETCH_FLAG_HASHES |
+						  OMNISKETCH_FLAG_POW2_WIDTH |
+						  OMNISKETCH_FLAG_PACKED |
+						  OMNISKETCH_FLAG_NARROW_ITEMS |
+						  OMNISKETCH_FLAG_SOA |
+						  OMNISKETCH_FLAG_WIDE_COUNTS |
+						  OMNISKETCH_FLAG_DOUBLE_HASH |
+						  OMNISKETCH_FLAG_WINDOW |
+						  SKETCH_RANGE_BITS_MASK))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: unknown flags %08x",
+						sketch->flags)));
+
+	/* wide counters only exist for the SoA layout, and need the extra
+	 * header bytes holding the 64-bit record count */
+	if (SKETCH_HAS_WIDE_COUNTS(sketch) &&
+		(!SKETCH_HAS_SOA(sketch) ||
+		 ((Size) nbytes < SKETCH_HEADER_BYTES(sketch) - VARHDRSZ)))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: message too short")));
+
+	/*
+	 * Windowed sketches always use wide counters (which also guarantees the
+	 * extended header fits, thanks to the check above), the sub-sketches
+	 * have to split evenly into the epoch slots, and the dyadic levels are
+	 * only built for regular sketches.
+	 */
+	if (SKETCH_HAS_WINDOW(sketch))
+	{
+		if (!SKETCH_HAS_WIDE_COUNTS(sketch))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid omnisketch binary data: windowed sketch without wide counters")));
+
+		if ((SKETCH_WINDOW(sketch)->nepochs < 1) ||
+			(SKETCH_WINDOW(sketch)->epoch < 0) ||
+			(sketch->numSketches % SKETCH_WINDOW(sketch)->nepochs != 0) ||
+			(SKETCH_RANGE_BITS(sketch) != 0))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid omnisketch binary data: invalid window parameters")));
+	}
+
+	/*
+	 * Narrow items imply itemSize < 32 (see omnisketch_params) - the ID
+	 * masking in omnisketch_next_id shifts by itemSize, so a full-width
+	 * narrow sketch would be undefined behavior, not just inconsistent.
+	 */
+	if ((sketch->numSketches < 1) ||
+		(sketch->sketchWidth < 1) ||
+		(sketch->sketchHeight < 1) ||
+		(sketch->sampleSize < 1) ||
+		(sketch->itemSize < 1) || (sketch->itemSize > 32) ||
+		(SKETCH_HAS_NARROW_ITEMS(sketch) && (sketch->itemSize == 32)) ||
+		(sketch_get_count(sketch) < 0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: invalid sketch parameters")));
+
+	if (SKETCH_HAS_POW2_WIDTH(sketch) &&
+		((sketch->sketchWidth & (sketch->sketchWidth - 1)) != 0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: width %d is not a power of two",
+						sketch->sketchWidth)));
+
+	if (SKETCH_RANGE_BITS(sketch) > sketch->numSketches)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: invalid number of dyadic levels")));
+
+	/*
+	 * Every packed bucket takes at least two bytes (the two varints), so
+	 * this bounds the dimensions by the message length - in particular it
+	 * guarantees the bucket count fits in an int before we use it below.
+	 */
+	if ((int64) sketch->numSketches * sketch->sketchWidth * sketch->sketchHeight * 2 >
+		(int64) nbytes - (int64) (SKETCH_HEADER_BYTES(sketch) - VARHDRSZ))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: message too short for the sketch dimensions")));
+
+	nbuckets = SKETCH_NBUCKETS(sketch);
+
+	ptr = (char *) sketch + SKETCH_HEADER_BYTES(sketch);
+	end = (char *) sketch + VARHDRSZ + nbytes;
+
+	for (int i = 0; i < nbuckets; i++)
+	{
+		uint64		totalCount;
+		uint64		sampleCount;
+
+		ptr = omnisketch_decode_varint_safe(ptr, end, &totalCount);
+		if (ptr != NULL)
+			ptr = omnisketch_decode_varint_safe(ptr, end, &sampleCount);
+
+		if (ptr == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid omnisketch binary data: truncated bucket data")));
+
+		if ((!SKETCH_HAS_WIDE_COUNTS(sketch) && (totalCount > PG_UINT32_MAX)) ||
+			(totalCount > (uint64) sketch_get_count(sketch)) ||
+			(sampleCount > (uint64) sketch->sampleSize) ||
+			(sampleCount > totalCount) ||
+			((sampleCount == 0) && (totalCount != 0)))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid omnisketch binary data: invalid bucket counters")));
+
+		if ((Size) (end - ptr) < sampleCount * SKETCH_ITEM_BYTES(sketch))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid omnisketch binary data: truncated bucket data")));
+
+		ptr += sampleCount * SKETCH_ITEM_BYTES(sketch);
+
+		/*
+		 * Every record lands in exactly one bucket of each row, so the
+		 * counters of every sketchWidth consecutive buckets have to sum
+		 * to the total number of records (same as AssertCheckSketch). In a
+		 * windowed sketch each epoch slot only holds a part of the records,
+		 * so the per-row sums are accumulated across the slots of each
+		 * attribute and checked after the walk.
+		 */
+		rowCount += totalCount;
+
+		if ((i + 1) % sketch->sketchWidth == 0)
+		{
+			if (SKETCH_HAS_WINDOW(sketch))
+			{
+				int		nattrs = sketch->numSketches / SKETCH_WINDOW(sketch)->nepochs;
+				int		row = i / sketch->sketchWidth;
+				int		attr = (row / sketch->sketchHeight) % nattrs;
+
+				if (windowRowCounts == NULL)
+					windowRowCounts = palloc0(nattrs * sketch->sketchHeight *
+											  sizeof(uint64));
+
+				windowRowCounts[attr * sketch->sketchHeight +
+								(row % sketch->sketchHeight)] += rowCount;
+			}
+			else if (rowCount != (uint64) sketch_get_count(sketch))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("invalid omnisketch binary data: bucket counters do not sum to the record count")));
+
+			rowCount = 0;
+		}
+	}
+
+	if (windowRowCounts != NULL)
+	{
+		int		nattrs = sketch->numSketches / SKETCH_WINDOW(sketch)->nepochs;
+
+		for (int i = 0; i < nattrs * sketch->sketchHeight; i++)
+		{
+			if (windowRowCounts[i] != (uint64) sketch_get_count(sketch))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("invalid omnisketch binary data: bucket counters do not sum to the record count")));
+		}
+
+		pfree(windowRowCounts);
+	}
+
+	if (ptr != end)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid omnisketch binary data: unexpected trailing data")));
+
+	PG_RETURN_POINTER(sketch);
+}
+
+Datum
+omnisketch_send(PG_FUNCTION_ARGS)
+{
+	omnisketch_t   *sketch
+		= (omnisketch_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+	StringInfoData	buf;
+
+	/* always ship the compact format */
+	if (!SKETCH_IS_PACKED(sketch))
+	{
+		sketch = omnisketch_copy(sketch);
+		omnisketch_sort(sketch);
+		sketch = omnisketch_pack_sketch(sketch);
+	}
+
+	pq_begintypsend(&buf);
+	pq_sendbytes(&buf, VARDATA(sketch), VARSIZE(sketch) - VARHDRSZ);
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum
+omnisketch_count(PG_FUNCTION_ARGS)
+{
+	omnisketch_t *sketch = PG_GETARG_OMNISKETCH(0);
+
+	PG_RETURN_INT64(sketch_get_count(sketch));
+}
+
+/*
+ * Scalar intersection kernel - walk two item lists sorted by (hash, item)
+ * and keep the matching items (and their hashes). Comparing the hash first
+ * and the item only on hash equality deals with hash collisions. The result
+ * arrays may alias "a"/"ah" - we only ever write to positions already read
+ * (k <= i).
+ */
+static int
+intersect_kernel_scalar(const int32 *a, const uint32 *ah, int na,
+						const int32 *b, const uint32 *bh, int nb,
+						int32 *result, uint32 *rh)
+{
+	int		i = 0,
+			j = 0,
+			k = 0;
+
+	while ((i < na) && (j < nb))
+	{
+		if (ah[i] < bh[j])
+			i++;
+		else if (ah[i] > bh[j])
+			j++;
+		else if (a[i] < b[j])	/* hash collision, compare the items too */
+			i++;
+		else if (a[i] > b[j])
+			j++;
+		else
+		{
+			result[k] = a[i];
+			rh[k] = ah[i];
+			k++;
+			i++;
+			j++;
+		}
+	}
+
+	return k;
+}
+
+/*
+ * Galloping intersection kernel for very asymmetric lists - once a
+ * selective column has pruned the candidate list to a few dozen items,
+ * merging it against a full 1000-item sample still walks the whole long
+ * list. Instead, look up each element of the short list in the long one
+ * by exponential search (gallop to bracket the hash, then binary search
+ * within the bracket), turning the O(n + m) merge into O(m log n).
+ *
+ * The search resumes where the previous element left off, so the whole
+ * pass never moves backwards through the long list. Hash collisions are
+ * resolved by a short linear walk over the equal-hash run, same as the
+ * merge kernels. The result arrays may alias either input - writes of
+ * the k-th match trail the reads in both lists (there are at least k
+ * earlier elements in each).
+ */
+static int
+intersect_kernel_gallop(const int32 *s, const uint32 *sh, int ns,
+						const int32 *l, const uint32 *lh, int nl,
+						int32 *result, uint32 *rh)
+{
+	int		j = 0,
+			k = 0;
+
+	for (int i = 0; i < ns; i++)
+	{
+		int		lo,
+				hi,
+				step = 1;
+
+		/* gallop until the step overshoots the hash (or the list) */
+		while ((j + step < nl) && (lh[j + step] < sh[i]))
+		{
+			j += step;
+			step *= 2;
+		}
+
+		/* binary search the bracket for the first hash >= sh[i] */
+		lo = j;
+		hi = Min(j + step, nl);
+
+		while (lo < hi)
+		{
+			int		mid = lo + (hi - lo) / 2;
+
+			if (lh[mid] < sh[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		j = lo;
+
+		/* hash collisions - walk the equal-hash run, comparing the items */
+		while ((j < nl) && (lh[j] == sh[i]) && (l[j] < s[i]))
+			j++;
+
+		if ((j < nl) && (lh[j] == sh[i]) && (l[j] == s[i]))
+		{
+			result[k] = s[i];
+			rh[k] = sh[i];
+			k++;
+			j++;
+		}
+
+		/* the long list is exhausted, nothing else can match */
+		if (j >= nl)
+			break;
+	}
+
+	return k;
+}
+
+/*
+ * Length ratio at which the galloping kernel wins over the merge - the
+ * merge costs O(n + m), the gallop O(m log n), so with n ~ 1024 (the
+ * sample size cap) the break-even is roughly a factor of log n ~ 10.
+ * Use a more conservative factor to stay clear of the SIMD merge.
+ */
+#define INTERSECT_GALLOP_RATIO	32
+
+#ifdef OMNISKETCH_SIMD_X86
+
+/* do the two 4-element blocks of hashes share any value? */
+static inline bool
+block_has_match_sse2(const uint32 *ah, const uint32 *bh)
+{
+	__m128i		va = _mm_loadu_si128((const __m128i *) ah);
+	__m128i		vb = _mm_loadu_si128((const __m128i *) bh);
+	__m128i		match = _mm_cmpeq_epi32(va, vb);
+
+	/* compare against the three remaining rotations of the b block */
+	match = _mm_or_si128(match, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x39)));
+	match = _mm_or_si128(match, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4e)));
+	match = _mm_or_si128(match, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x93)));
+
+	return (_mm_movemask_epi8(match) != 0);
+}
+
+/*
+ * SSE2 intersection kernel - process the lists in blocks of 4 hashes, and
+ * skip whole blocks that provably contain no match. Blocks that do match
+ * (or may, due to a hash collision) are resolved by the scalar code, one
+ * element at a time.
+ *
+ * Skipping a whole block is safe - the lists are sorted, so if none of the
+ * current b-block hashes equals any of the a-block ones, elements of the
+ * block ending first can't match anything beyond the other block either.
+ */
+static int
+intersect_kernel_sse2(const int32 *a, const uint32 *ah, int na,
+					  const int32 *b, const uint32 *bh, int nb,
+					  int32 *result, uint32 *rh)
+{
+	int		i = 0,
+			j = 0,
+			k = 0;
+
+	while ((i + 4 <= na) && (j + 4 <= nb))
+	{
+		if (ah[i + 3] < bh[j])	/* the hash ranges don't even overlap */
+			i += 4;
+		else if (bh[j + 3] < ah[i])
+			j += 4;
+		else if (!block_has_match_sse2(&ah[i], &bh[j]))
+		{
+			/* overlapping ranges but no match, skip the earlier block */
+			if (ah[i + 3] < bh[j + 3])
+				i += 4;
+			else
+				j += 4;
+		}
+		else
+		{
+			/* resolve the matches (and possible collisions) one by one */
+			int		iend = i + 4,
+					jend = j + 4;
+
+			while ((i < iend) && (j < jend))
+			{
+				if (ah[i] < bh[j])
+					i++;
+				else if (ah[i] > bh[j])
+					j++;
+				else if (a[i] < b[j])
+					i++;
+				else if (a[i] > b[j])
+					j++;
+				else
+				{
+					result[k] = a[i];
+					rh[k] = ah[i];
+					k++;
+					i++;
+					j++;
+				}
+			}
+		}
+	}
+
+	/* let the scalar kernel deal with the remaining pieces of the lists */
+	return k + intersect_kernel_scalar(a + i, ah + i, na - i,
+									   b + j, bh + j, nb - j,
+									   result + k, rh + k);
+}
+
+/* same idea as the SSE2 kernel, but with blocks of 8 hashes */
+__attribute__((target("avx2")))
+static int
+intersect_kernel_avx2(const int32 *a, const uint32 *ah, int na,
+					  const int32 *b, const uint32 *bh, int nb,
+					  int32 *result, uint32 *rh)
+{
+	int		i = 0,
+			j = 0,
+			k = 0;
+
+	while ((i + 8 <= na) && (j + 8 <= nb))
+	{
+		if (ah[i + 7] < bh[j])	/* the hash ranges don't even overlap */
+			i += 8;
+		else if (bh[j + 7] < ah[i])
+			j += 8;
+		else
+		{
+			__m256i		va = _mm256_loadu_si256((const __m256i *) &ah[i]);
+			__m256i		vb = _mm256_loadu_si256((const __m256i *) &bh[j]);
+			__m256i		match = _mm256_cmpeq_epi32(va, vb);
+
+			/* compare against the seven remaining rotations of b */
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi32(va,
+						_mm256_permutevar8x32_epi32(vb, _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0))));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi32(va,
+						_mm256_permutevar8x32_epi32(vb, _mm256_setr_epi32(2, 3, 4, 5, 6, 7, 0, 1))));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi32(va,
+						_mm256_permutevar8x32_epi32(vb, _mm256_setr_epi32(3, 4, 5, 6, 7, 0, 1, 2))));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi32(va,
+						_mm256_permutevar8x32_epi32(vb, _mm256_setr_epi32(4, 5, 6, 7, 0, 1, 2, 3))));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi32(va,
+						_mm256_permutevar8x32_epi32(vb, _mm256_setr_epi32(5, 6, 7, 0, 1, 2, 3, 4))));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi32(va,
+						_mm256_permutevar8x32_epi32(vb, _mm256_setr_epi32(6, 7, 0, 1, 2, 3, 4, 5))));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi32(va,
+						_mm256_permutevar8x32_epi32(vb, _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6))));
+
+			if (_mm256_testz_si256(match, match))
+			{
+				/* overlapping ranges but no match, skip the earlier block */
+				if (ah[i + 7] < bh[j + 7])
+					i += 8;
+				else
+					j += 8;
+			}
+			else
+			{
+				/* resolve the matches one by one */
+				int		iend = i + 8,
+						jend = j + 8;
+
+				while ((i < iend) && (j < jend))
+				{
+					if (ah[i] < bh[j])
+						i++;
+					else if (ah[i] > bh[j])
+						j++;
+					else if (a[i] < b[j])
+						i++;
+					else if (a[i] > b[j])
+						j++;
+					else
+					{
+						result[k] = a[i];
+						rh[k] = ah[i];
+						k++;
+						i++;
+						j++;
+					}
+				}
+			}
+		}
+	}
+
+	/* let the scalar kernel deal with the remaining pieces of the lists */
+	return k + intersect_kernel_scalar(a + i, ah + i, na - i,
+									   b + j, bh + j, nb - j,
+									   result + k, rh + k);
+}
+
+#endif							/* OMNISKETCH_SIMD_X86 */
+
+typedef int (*intersect_kernel_fn) (const int32 *a, const uint32 *ah, int na,
+									const int32 *b, const uint32 *bh, int nb,
+									int32 *result, uint32 *rh);
+
+/* pick the best available kernel (determined once, on the first call) */
+static intersect_kernel_fn
+intersect_kernel_choose(void)
+{
+#ifdef OMNISKETCH_SIMD_X86
+	if (__builtin_cpu_supports("avx2"))
+		return intersect_kernel_avx2;
+
+	return intersect_kernel_sse2;
+#else
+	return intersect_kernel_scalar;
+#endif
+}
+
+static int
+intersect_kernel(const int32 *a, const uint32 *ah, int na,
+				 const int32 *b, const uint32 *bh, int nb,
+				 int32 *result, uint32 *rh)
+{
+	static intersect_kernel_fn kernel = NULL;
 
-	/* nothing to do if the second bucket is empty */
-	if (src_bucket->sampleCount == 0)
-		return;
+	/* very asymmetric lists - search instead of merging */
+	if (na > nb * INTERSECT_GALLOP_RATIO)
+		return intersect_kernel_gallop(b, bh, nb, a, ah, na, result, rh);
 
-	dst_items = omnisketch_sorted_items(dst_bucket, dst_sample);
-	src_items = omnisketch_sorted_items(src_bucket, src_sample);
+	if (nb > na * INTERSECT_GALLOP_RATIO)
+		return intersect_kernel_gallop(a, ah, na, b, bh, nb, result, rh);
 
-	i = j = k = 0;
-	while ((k < sampleSize) &&
-		   (i < dst_bucket->sampleCount || j < src_bucket->sampleCount))
+	if (unlikely(kernel == NULL))
+		kernel = intersect_kernel_choose();
+
+	return kernel(a, ah, na, b, bh, nb, result, rh);
+}
+
+/*
+ * calculate intersection of an item list passed as the first argument, and
+ * a new item list. This relies on the fact that the existing list can only
+ * ever shrink, and both lists being sorted.
+ *
+ * The item list carries the hashes, so only the new list may need hashing
+ * (and only for old sketches without stored hashes, i.e. tmp_hashes NULL).
+ * Narrow samples get widened into a temporary int32 array, as the kernels
+ * only work with full-width items.
+ */
+static void
+intersect_items(omnisketch_t *sketch, item_list_t *items, int n,
+				void *tmp, uint32 *tmp_hashes)
+{
+	int32	   *b = (int32 *) tmp;
+	uint32	   *bh = tmp_hashes;
+
+	if (SKETCH_HAS_NARROW_ITEMS(sketch))
 	{
-		if (i == dst_bucket->sampleCount)
+		b = (int32 *) palloc(sizeof(int32) * n);
+
+		for (int j = 0; j < n; j++)
+			b[j] = sketch_sample_get(sketch, tmp, j);
+	}
+
+	if (bh == NULL)
+	{
+		bh = (uint32 *) palloc(sizeof(uint32) * n);
+
+		for (int j = 0; j < n; j++)
+			bh[j] = SKETCH_HASH(b[j], SKETCH_SEED);
+	}
+
+	items->nitems = intersect_kernel(items->items, items->hashes, items->nitems,
+									 b, bh, n,
+									 items->items, items->hashes);
+
+	if (b != tmp)
+		pfree(b);
+
+	if (bh != tmp_hashes)
+		pfree(bh);
+}
+
+/*
+ * Calculate the estimate using the algorithm from the paper. Visit all the
+ * buckets matching the equality conditions, build the intersection of item
+ * lists, etc.
+ *
+ * FIXME add info about function arguments
+ */
+static item_list_t *
+omnisketch_column_estimate(omnisketch_t *sketch, int column, int32 hash,
+						   int64 *maxcnt, item_list_t *items)
+{
+	omnisketch_pos_t pos = omnisketch_bucket_positions(sketch, (uint32) hash);
+
+	for (int i = 0; i < sketch->sketchHeight; i++)
+	{
+		bucket_t	bucket;
+		void	   *sample;
+		uint32	   *hashes;
+
+		int		j = omnisketch_bucket_position(sketch, pos, i);
+
+		sketch_bucket_load(sketch, SKETCH_BUCKET_INDEX(sketch, column, i, j),
+						   &bucket);
+		sample = SKETCH_SAMPLE(sketch, column, i, j);
+		hashes = SKETCH_SAMPLE_HASHES(sketch, column, i, j);
+
+		if ((int64) bucket.totalCount > *maxcnt)
+			*maxcnt = (int64) bucket.totalCount;
+
+		/*
+		 * First time through, just keep the list, otherwise merge the sample
+		 * into the existing list. This is more efficient than bms_intersect
+		 * (which also has to build the bitmap first).
+		 */
+		if (items == NULL)
 		{
-			dst_sample[k++] = src_items[j].item;
-			dst_bucket->maxHash = src_items[j++].hash;
-			continue;
+			items = palloc(sizeof(item_list_t));
+			items->nitems = bucket.sampleCount;
+			items->items = palloc(sizeof(int32) * items->nitems);
+			items->hashes = palloc(sizeof(uint32) * items->nitems);
+
+			if (SKETCH_HAS_NARROW_ITEMS(sketch))
+			{
+				for (int k = 0; k < items->nitems; k++)
+					items->items[k] = sketch_sample_get(sketch, sample, k);
+			}
+			else
+				memcpy(items->items, sample, sizeof(int32) * items->nitems);
+
+			if (hashes != NULL)
+				memcpy(items->hashes, hashes, sizeof(uint32) * items->nitems);
+			else
+			{
+				for (int k = 0; k < items->nitems; k++)
+					items->hashes[k] = SKETCH_HASH(items->items[k], SKETCH_SEED);
+			}
 		}
-		else if (j == src_bucket->sampleCount)
+		else
 		{
-			dst_sample[k++] = dst_items[i].item;
-			dst_bucket->maxHash = dst_items[i++].hash;
-			continue;
+			intersect_items(sketch, items, bucket.sampleCount, sample, hashes);
 		}
 
-		/* FIXME shouldn't really happen, I think, or maybe advance both? */
-		Assert(cmp_item_hash(&dst_items[i], &src_items[j]) != 0);
+		/*
+		 * An empty intersection can only stay empty - the estimate is
+		 * already determined to be 0, skip the remaining rows.
+		 */
+		if (items->nitems == 0)
+			break;
+	}
+
+	return items;
+}
+
+/*
+ * Same as omnisketch_column_estimate, but reading the probed buckets from
+ * a stored sketch through slices (see omnisketch_slice_begin) instead of
+ * a fully detoasted value. Only the counters, the used part of the sample
+ * and its hashes are fetched for each of the sketchHeight buckets.
+ */
+static item_list_t *
+omnisketch_column_estimate_slice(omnisketch_slice_t *slice, int column,
+								 int32 hash, int64 *maxcnt, item_list_t *items)
+{
+	omnisketch_t *hdr = slice->hdr;
+
+	Size	hdrlen = SKETCH_HEADER_BYTES(hdr);
+	Size	nbuckets = SKETCH_NBUCKETS(hdr);
+	Size	itemBytes = SKETCH_ITEM_BYTES(hdr);
+	Size	samplesOff = hdrlen + SKETCH_BUCKETS_BYTES(hdr);
+	Size	hashesOff = samplesOff +
+		MAXALIGN(nbuckets * itemBytes * hdr->sampleSize);
 
-		if (cmp_item_hash(&dst_items[i], &src_items[j]) > 0)
+	/* scratch space for the fetched sample (and hashes), reused */
+	char   *sample = palloc(hdr->sampleSize * itemBytes);
+	uint32 *hashes = SKETCH_HAS_HASHES(hdr) ?
+		palloc(hdr->sampleSize * sizeof(uint32)) : NULL;
+
+	omnisketch_pos_t pos = omnisketch_bucket_positions(hdr, (uint32) hash);
+
+	for (int i = 0; i < hdr->sketchHeight; i++)
+	{
+		bucket_t	bucket;
+
+		int		j = omnisketch_bucket_position(hdr, pos, i);
+		Size	idx = SKETCH_BUCKET_INDEX(hdr, column, i, j);
+
+		/* fetch the bucket counters */
+		if (SKETCH_HAS_SOA(hdr))
 		{
-			dst_sample[k++] = src_items[j].item;
-			dst_bucket->maxHash = src_items[j++].hash;
+			uint16		sampleCount;
+
+			if (SKETCH_HAS_WIDE_COUNTS(hdr))
+			{
+				uint64		totalCount;
+
+				omnisketch_fetch_slice(slice->value,
+									   hdrlen + idx * sizeof(uint64),
+									   sizeof(uint64), &totalCount);
+
+				bucket.totalCount = totalCount;
+			}
+			else
+			{
+				uint32		totalCount;
+
+				omnisketch_fetch_slice(slice->value,
+									   hdrlen + idx * sizeof(uint32),
+									   sizeof(uint32), &totalCount);
+
+				bucket.totalCount = totalCount;
+			}
+
+			omnisketch_fetch_slice(slice->value,
+								   hdrlen + MAXALIGN(nbuckets * SKETCH_COUNTER_BYTES(hdr)) +
+								   idx * sizeof(uint16),
+								   sizeof(uint16), &sampleCount);
+
+			bucket.sampleCount = sampleCount;
 		}
 		else
 		{
-			dst_sample[k++] = dst_items[i].item;
-			dst_bucket->maxHash = dst_items[i++].hash;
+			bucket_disk_t	disk;
+
+			omnisketch_fetch_slice(slice->value,
+								   hdrlen + idx * sizeof(bucket_disk_t),
+								   sizeof(bucket_disk_t), &disk);
+
+			bucket.totalCount = disk.totalCount;
+			bucket.sampleCount = disk.sampleCount;
+			bucket.maxIndex = disk.maxIndex;
+			bucket.maxHash = disk.maxHash;
+			bucket.isSorted = disk.isSorted;
 		}
-	}
 
-	pfree(dst_items);
-	pfree(src_items);
+		/* fetch the used part of the sample (and the stored hashes) */
+		if (bucket.sampleCount > 0)
+		{
+			omnisketch_fetch_slice(slice->value,
+								   samplesOff + idx * hdr->sampleSize * itemBytes,
+								   bucket.sampleCount * itemBytes, sample);
+
+			if (hashes != NULL)
+				omnisketch_fetch_slice(slice->value,
+									   hashesOff + idx * hdr->sampleSize * sizeof(uint32),
+									   bucket.sampleCount * sizeof(uint32), hashes);
+		}
 
-	Assert(k >= Max(dst_bucket->sampleCount, src_bucket->sampleCount));
+		if ((int64) bucket.totalCount > *maxcnt)
+			*maxcnt = (int64) bucket.totalCount;
 
-	dst_bucket->totalCount += src_bucket->totalCount;
-	dst_bucket->isSorted = true;
-	dst_bucket->sampleCount = k;
-	dst_bucket->maxIndex = (dst_bucket->sampleCount - 1);
+		/* same merging as the regular path, on the fetched buffers */
+		if (items == NULL)
+		{
+			items = palloc(sizeof(item_list_t));
+			items->nitems = bucket.sampleCount;
+			items->items = palloc(sizeof(int32) * items->nitems);
+			items->hashes = palloc(sizeof(uint32) * items->nitems);
+
+			if (SKETCH_HAS_NARROW_ITEMS(hdr))
+			{
+				for (int k = 0; k < items->nitems; k++)
+					items->items[k] = sketch_sample_get(hdr, sample, k);
+			}
+			else
+				memcpy(items->items, sample, sizeof(int32) * items->nitems);
+
+			if (hashes != NULL)
+				memcpy(items->hashes, hashes, sizeof(uint32) * items->nitems);
+			else
+			{
+				for (int k = 0; k < items->nitems; k++)
+					items->hashes[k] = SKETCH_HASH(items->items[k], SKETCH_SEED);
+			}
+		}
+		else
+		{
+			intersect_items(hdr, items, bucket.sampleCount, sample, hashes);
+		}
 
-	AssertCheckBucket(dst, dst_bucket, dst_sample);
+		/*
+		 * An empty intersection can only stay empty - the estimate is
+		 * already determined to be 0, skip the remaining rows (and the
+		 * slice fetches they would do).
+		 */
+		if (items->nitems == 0)
+			break;
+	}
+
+	pfree(sample);
+	if (hashes != NULL)
+		pfree(hashes);
+
+	return items;
 }
 
 /*
- * Combine two sketches, the first sketch is updated with the result and then
- * returned (if NULL, a new sketch is allocated). Used as combine function for
- * parallel aggregates.
+ * Estimate for a windowed sketch - a single pass over the ring, no merging.
+ * The record IDs of different epochs are unrelated (each slot samples its
+ * own records), so the intersection of the per-attribute samples is only
+ * meaningful within one epoch slot - build it per slot, and sum the
+ * per-epoch estimates. The hashes of the predicate values are computed
+ * once by the caller ("used" marks the constrained attributes).
  */
+static int64
+omnisketch_estimate_window(omnisketch_t *sketch, omnisketch_slice_t *slice,
+						   bool sliced, int nattrs, uint32 *hashes,
+						   bool *used)
+{
+	int			nepochs = SKETCH_WINDOW(sketch)->nepochs;
+	int64		est = 0;
+
+	for (int e = 0; e < nepochs; e++)
+	{
+		int64			maxcnt = 0;
+		item_list_t	   *items = NULL;
+
+		for (int i = 0; i < nattrs; i++)
+		{
+			if (!used[i])
+				continue;
+
+			if (sliced)
+				items = omnisketch_column_estimate_slice(slice, e * nattrs + i,
+														 hashes[i], &maxcnt,
+														 items);
+			else
+				items = omnisketch_column_estimate(sketch, e * nattrs + i,
+												   hashes[i], &maxcnt, items);
+
+			/* the epoch contributes nothing, skip its remaining columns */
+			if (items->nitems == 0)
+				break;
+		}
+
+		Assert(items != NULL);
+
+		est += maxcnt / sketch->sampleSize * items->nitems;
+
+		omnisketch_free_items(items);
+	}
+
+	return est;
+}
+
 Datum
-omnisketch_combine(PG_FUNCTION_ARGS)
+omnisketch_estimate(PG_FUNCTION_ARGS)
 {
-	omnisketch_t	 *src;
-	omnisketch_t	 *dst;
-	MemoryContext aggcontext;
-	MemoryContext oldcontext;
+	omnisketch_t *sketch = NULL;
+	HeapTupleHeader record = PG_GETARG_HEAPTUPLEHEADER(1);
+	omnisketch_scratch_t *scratch;
+	int			ncolumns;
+	int64		maxcnt = 0;
+	item_list_t  *items = NULL;
+	double		est;
+	omnisketch_slice_t slice;
+	bool		sliced;
+	int			nattrs;
+	uint32	   *colhashes = NULL;
+	bool	   *colused = NULL;
+	int			nused = 0;
 
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "omnisketch_combine called in non-aggregate context");
+	scratch = omnisketch_scratch_init(fcinfo, record);
+	ncolumns = scratch->ncolumns;
 
-	/* if no "merged" state yet, try creating it */
+	/* make sure to have a sketch */
 	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	/* read only the probed buckets of stored sketches, if possible */
+	sliced = omnisketch_slice_begin(PG_GETARG_DATUM(0), &slice);
+
+	sketch = sliced ? slice.hdr : PG_GETARG_OMNISKETCH(0);
+
+	if (!sliced)
+		AssertCheckSketch(sketch);
+
+	/* a windowed sketch keeps one sub-sketch per (epoch, attribute) pair */
+	nattrs = SKETCH_HAS_WINDOW(sketch) ?
+		(sketch->numSketches / SKETCH_WINDOW(sketch)->nepochs) :
+		sketch->numSketches;
+
+	if (nattrs != ncolumns)
+		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+			 ncolumns, nattrs);
+
+	/* Break down the tuple into fields */
+	omnisketch_scratch_deform(scratch, record);
+
+	/* the windowed pass below needs the hashes of all the columns first */
+	if (SKETCH_HAS_WINDOW(sketch))
 	{
-		/* nope, the second argument is NULL to, so return NULL */
-		if (PG_ARGISNULL(1))
-			PG_RETURN_NULL();
+		colhashes = (uint32 *) palloc(ncolumns * sizeof(uint32));
+		colused = (bool *) palloc0(ncolumns * sizeof(bool));
+	}
 
-		/* the second argument is not NULL, so copy it */
-		src = (omnisketch_t *) PG_GETARG_OMNISKETCH(1);
+	for (int i = 0; i < ncolumns; i++)
+	{
+		uint32		element_hash;
 
-		/* copy the sketch into the right long-lived memory context */
-		oldcontext = MemoryContextSwitchTo(aggcontext);
-		dst = omnisketch_copy(src);
-		MemoryContextSwitchTo(oldcontext);
+		/* dropped column */
+		if (scratch->hashfcinfo[i] == NULL)
+			continue;
 
-		PG_RETURN_POINTER(dst);
+		/* a NULL is a wildcard - no constraint on this attribute */
+		if (scratch->nulls[i])
+			continue;
+
+		element_hash = omnisketch_scratch_hash(scratch, i);
+
+		/* windowed sketch - just remember the hash for the pass below */
+		if (SKETCH_HAS_WINDOW(sketch))
+		{
+			colhashes[i] = element_hash;
+			colused[i] = true;
+			nused++;
+			continue;
+		}
+
+		if (sliced)
+			items = omnisketch_column_estimate_slice(&slice, i, element_hash,
+													 &maxcnt, items);
+		else
+			items = omnisketch_column_estimate(sketch, i, element_hash,
+											   &maxcnt, items);
+
+		/*
+		 * The estimate is already 0 - skip the remaining columns (and
+		 * their hash function calls).
+		 */
+		if (items->nitems == 0)
+			break;
 	}
 
-	/*
-	 * If the second argument is NULL, just return the first one (we know
-	 * it's not NULL at this point).
-	 */
-	if (PG_ARGISNULL(1))
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	/* Avoid leaking memory when handed toasted input. */
+	// PG_FREE_IF_COPY(record, 0);
 
-	/* Now we know neither argument is NULL, so merge them. */
-	dst = (omnisketch_t *) PG_GETARG_OMNISKETCH(0);
-	src = (omnisketch_t *) PG_GETARG_OMNISKETCH(1);
+	/* windowed sketch - intersect within each live epoch, sum the estimates */
+	if (SKETCH_HAS_WINDOW(sketch))
+	{
+		int64	result;
 
-	AssertCheckSketch(dst);
-	AssertCheckSketch(src);
+		/* all attributes unconstrained - everything live matches */
+		if (nused == 0)
+			PG_RETURN_INT64(sketch_get_count(sketch));
+
+		result = omnisketch_estimate_window(sketch, &slice, sliced,
+											ncolumns, colhashes, colused);
+
+		pfree(colhashes);
+		pfree(colused);
+
+		PG_RETURN_INT64(result);
+	}
+
+	/* all attributes unconstrained - everything matches */
+	if (items == NULL)
+		PG_RETURN_INT64(sketch_get_count(sketch));
+
+	est = maxcnt / sketch->sampleSize * items->nitems;
+
+	pfree(items->items);
+	pfree(items->hashes);
+	pfree(items);
+
+	PG_RETURN_INT64(est);
+}
+
+/*
+ * Estimate a whole array of predicate records in one call, returning an
+ * array of the estimates (in the same order, with NULL records producing
+ * NULL estimates). The point is amortizing the per-call overhead - the
+ * sketch is detoasted (and a packed sketch expanded) just once, and the
+ * row-type lookup and the values/nulls arrays are shared by all the
+ * records, which matters when issuing many estimates against the same
+ * (possibly large) sketch.
+ */
+Datum
+omnisketch_estimate_batch(PG_FUNCTION_ARGS)
+{
+	omnisketch_t   *sketch;
+	ArrayType	   *batch;
+	ArrayIterator	iter;
+	Datum			value;
+	bool			isnull;
+
+	Oid			tupType = InvalidOid;
+	int32		tupTypmod = -1;
+	TupleDesc	tupdesc = NULL;
+	int			ncolumns = 0;
+	TypeCacheEntry **my_extra = NULL;
+	Datum	   *values = NULL;
+	bool	   *nulls = NULL;
+	int			nattrs;
+	uint32	   *colhashes = NULL;
+	bool	   *colused = NULL;
+
+	Datum	   *results;
+	bool	   *resnulls;
+	int			nresults = 0;
+	int			dims[1];
+	int			lbs[1];
+
+	batch = PG_GETARG_ARRAYTYPE_P(1);
+
+	if (!type_is_rowtype(ARR_ELEMTYPE(batch)))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("omnisketch_estimate_batch expects an array of records")));
+
+	/* detoast (and maybe unpack) the sketch once, for all the records */
+	sketch = PG_GETARG_OMNISKETCH(0);
+
+	AssertCheckSketch(sketch);
+
+	/* a windowed sketch keeps one sub-sketch per (epoch, attribute) pair */
+	nattrs = SKETCH_HAS_WINDOW(sketch) ?
+		(sketch->numSketches / SKETCH_WINDOW(sketch)->nepochs) :
+		sketch->numSketches;
+
+	results = (Datum *) palloc(ArrayGetNItems(ARR_NDIM(batch),
+											  ARR_DIMS(batch)) * sizeof(Datum));
+	resnulls = (bool *) palloc(ArrayGetNItems(ARR_NDIM(batch),
+											  ARR_DIMS(batch)) * sizeof(bool));
+
+	iter = array_create_iterator(batch, 0, NULL);
+
+	while (array_iterate(iter, &value, &isnull))
+	{
+		HeapTupleHeader	record;
+		HeapTupleData	tuple;
+		int64			maxcnt = 0;
+		item_list_t	   *items = NULL;
+		double			est;
+		int				nused = 0;
+
+		/* a NULL record has a NULL estimate */
+		if (isnull)
+		{
+			results[nresults] = (Datum) 0;
+			resnulls[nresults] = true;
+			nresults++;
+			continue;
+		}
+
+		record = DatumGetHeapTupleHeader(value);
+
+		/*
+		 * Lookup the tuple descriptor, unless we already have the right one
+		 * from the preceding elements (the common case - the elements of the
+		 * array have the same row type).
+		 */
+		if ((tupdesc == NULL) ||
+			(tupType != HeapTupleHeaderGetTypeId(record)) ||
+			(tupTypmod != HeapTupleHeaderGetTypMod(record)))
+		{
+			if (tupdesc != NULL)
+				ReleaseTupleDesc(tupdesc);
+
+			tupType = HeapTupleHeaderGetTypeId(record);
+			tupTypmod = HeapTupleHeaderGetTypMod(record);
+			tupdesc = lookup_rowtype_tupdesc(tupType, tupTypmod);
+
+			if (nattrs != tupdesc->natts)
+				elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+					 tupdesc->natts, nattrs);
+
+			ncolumns = tupdesc->natts;
+		}
+
+		/* first record - finish the setup we could not do without a tupdesc */
+		if (values == NULL)
+		{
+			my_extra = (TypeCacheEntry **) fcinfo->flinfo->fn_extra;
+			if (my_extra == NULL)
+			{
+				my_extra =
+					MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+										   sizeof(TypeCacheEntry *) * ncolumns);
+				fcinfo->flinfo->fn_extra = my_extra;
+			}
+
+			/* allocated once, reused for all the records */
+			values = (Datum *) palloc(ncolumns * sizeof(Datum));
+			nulls = (bool *) palloc(ncolumns * sizeof(bool));
+
+			if (SKETCH_HAS_WINDOW(sketch))
+			{
+				colhashes = (uint32 *) palloc(ncolumns * sizeof(uint32));
+				colused = (bool *) palloc(ncolumns * sizeof(bool));
+			}
+		}
+
+		/* Build temporary HeapTuple control structure */
+		tuple.t_len = HeapTupleHeaderGetDatumLength(record);
+		ItemPointerSetInvalid(&(tuple.t_self));
+		tuple.t_tableOid = InvalidOid;
+		tuple.t_data = record;
+
+		/* Break down the tuple into fields */
+		heap_deform_tuple(&tuple, tupdesc, values, nulls);
+
+		if (colused != NULL)
+			memset(colused, 0, ncolumns * sizeof(bool));
+
+		for (int i = 0; i < ncolumns; i++)
+		{
+			Form_pg_attribute att;
+			TypeCacheEntry *typentry;
+			uint32		element_hash;
+
+			att = TupleDescAttr(tupdesc, i);
+
+			if (att->attisdropped)
+				continue;
+
+			/* a NULL is a wildcard - no constraint on this attribute */
+			if (nulls[i])
+				continue;
 
-	if (!omnisketch_equals(src, dst))
-		elog(ERROR, "sketches do not match");
+			/*
+			 * Lookup the hash function if not done already
+			 */
+			typentry = my_extra[i];
+			if (typentry == NULL ||
+				typentry->type_id != att->atttypid)
+			{
+				typentry = lookup_type_cache(att->atttypid,
+											 TYPECACHE_HASH_EXTENDED_PROC_FINFO);
+				if (!OidIsValid(typentry->hash_extended_proc_finfo.fn_oid))
+					ereport(ERROR,
+							(errcode(ERRCODE_UNDEFINED_FUNCTION),
+							 errmsg("could not identify an extended hash function for type %s",
+									format_type_be(typentry->type_id))));
+				my_extra[i] = typentry;
+			}
 
-	for (int a = 0; a < src->numSketches; a++)
-	{
-		for (int i = 0; i < src->sketchHeight; i++)
-		{
-			for (int j = 0; j < src->sketchWidth; j++)
+			/* Compute hash of element */
 			{
-				bucket_t *dst_bucket = SKETCH_BUCKET(dst, a, i, j);
-				bucket_t *src_bucket = SKETCH_BUCKET(src, a, i, j);
+				LOCAL_FCINFO(locfcinfo, 2);
+
+				InitFunctionCallInfoData(*locfcinfo, &typentry->hash_extended_proc_finfo, 2,
+										 att->attcollation, NULL, NULL);
+				locfcinfo->args[0].value = values[i];
+				locfcinfo->args[0].isnull = false;
+				locfcinfo->args[1].value = Int64GetDatum(0);
+				locfcinfo->args[0].isnull = false;
+				element_hash = DatumGetUInt64(FunctionCallInvoke(locfcinfo));
+
+				/* We don't expect hash support functions to return null */
+				Assert(!locfcinfo->isnull);
+			}
 
-				int32 *dst_sample = SKETCH_SAMPLE(dst, a, i, j);
-				int32 *src_sample = SKETCH_SAMPLE(src, a, i, j);
+			/* windowed sketch - just remember the hash for the pass below */
+			if (SKETCH_HAS_WINDOW(sketch))
+			{
+				colhashes[i] = element_hash;
+				colused[i] = true;
+				nused++;
+				continue;
+			}
 
-				omnisketch_merge_buckets(dst, src,
-										 dst_bucket, src_bucket,
-										 dst_sample, src_sample,
-										 dst->sampleSize);
+			items = omnisketch_column_estimate(sketch, i, element_hash,
+											   &maxcnt, items);
 
-				AssertCheckBucket(dst, dst_bucket, dst_sample);
-				AssertCheckBucket(src, src_bucket, src_sample);
-			}
+			/*
+			 * The estimate is already 0 - skip the remaining columns (and
+			 * their hash function calls).
+			 */
+			if (items->nitems == 0)
+				break;
 		}
-	}
 
-	dst->count += src->count;
+		/* windowed sketch - intersect per live epoch, sum the estimates */
+		if (SKETCH_HAS_WINDOW(sketch) && (nused > 0))
+		{
+			results[nresults] = Int64GetDatum(omnisketch_estimate_window(sketch,
+															NULL, false,
+															ncolumns,
+															colhashes,
+															colused));
+			resnulls[nresults] = false;
+			nresults++;
+			continue;
+		}
 
-	AssertCheckSketch(dst);
+		/* all attributes unconstrained - everything matches */
+		if (items == NULL)
+		{
+			results[nresults] = Int64GetDatum(sketch_get_count(sketch));
+			resnulls[nresults] = false;
+			nresults++;
+			continue;
+		}
 
-	PG_RETURN_POINTER(dst);
-}
+		est = maxcnt / sketch->sampleSize * items->nitems;
 
-Datum
-omnisketch_in(PG_FUNCTION_ARGS)
-{
-	/*
-	 * omnisketch stores the data in binary form and parsing text input is
-	 * not needed, so disallow this.
-	 */
-	ereport(ERROR,
-			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-			 errmsg("cannot accept a value of type %s", "omnisketch")));
+		results[nresults] = Int64GetDatum((int64) est);
+		resnulls[nresults] = false;
+		nresults++;
 
-	PG_RETURN_VOID();			/* keep compiler quiet */
-}
+		omnisketch_free_items(items);
+	}
 
-Datum
-omnisketch_out(PG_FUNCTION_ARGS)
-{
-	return byteaout(fcinfo);
-}
+	array_free_iterator(iter);
 
-Datum
-omnisketch_recv(PG_FUNCTION_ARGS)
-{
-	ereport(ERROR,
-			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-			 errmsg("cannot accept a value of type %s", "omnisketch")));
+	if (values != NULL)
+	{
+		pfree(values);
+		pfree(nulls);
+	}
 
-	PG_RETURN_VOID();			/* keep compiler quiet */
-}
+	if (colused != NULL)
+	{
+		pfree(colhashes);
+		pfree(colused);
+	}
 
-Datum
-omnisketch_send(PG_FUNCTION_ARGS)
-{
-	return byteasend(fcinfo);
-}
+	if (tupdesc != NULL)
+		ReleaseTupleDesc(tupdesc);
 
-Datum
-omnisketch_count(PG_FUNCTION_ARGS)
-{
-	omnisketch_t *sketch = PG_GETARG_OMNISKETCH(0);
+	dims[0] = nresults;
+	lbs[0] = 1;
 
-	PG_RETURN_INT64(sketch->count);
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(results, resnulls, 1, dims, lbs,
+											 INT8OID, sizeof(int64),
+											 FLOAT8PASSBYVAL, 'd'));
 }
 
-/*
- * calculate intersection of an item list passed as the first argument, and
- * a new item list. This relies on the fact that the existing list can only
- * ever shrink, and both lists being sorted.
- */
-static void
-intersect_items(item_list_t *items, int n, int32 *tmp)
+/* copy of an item list (the intersections shrink the list in place) */
+static item_list_t *
+omnisketch_copy_items(item_list_t *items)
 {
-	int		i = 0,
-			j = 0,
-			k = 0;
-
-	/*
-	 * Walk the lists - both are sorted by hash of the item, so advance the
-	 * list with lower hash value.
-	 */
-	while ((i < items->nitems) && (j < n))
-	{
-		uint32	h1,
-				h2;
+	item_list_t *copy = palloc(sizeof(item_list_t));
 
-		if (items->items[i] == tmp[j])
-		{
-			items->items[k] = items->items[i];
-			i++;
-			j++;
-			k++;
-			continue;
-		}
+	copy->nitems = items->nitems;
+	copy->items = palloc(sizeof(int32) * items->nitems);
+	copy->hashes = palloc(sizeof(uint32) * items->nitems);
 
-		h1 = SKETCH_HASH(items->items[i], SKETCH_SEED);
-		h2 = SKETCH_HASH(tmp[j], SKETCH_SEED);
+	memcpy(copy->items, items->items, sizeof(int32) * items->nitems);
+	memcpy(copy->hashes, items->hashes, sizeof(uint32) * items->nitems);
 
-		/*
-		 * FIXME compare the item too, not just hash, there may be collisions
-		 * (even if not very likely)
-		 */
-		if (h1 < h2)
-			i++;
-		else
-			j++;
-	}
+	return copy;
+}
 
-	items->nitems = k;
+static void
+omnisketch_free_items(item_list_t *items)
+{
+	pfree(items->items);
+	pfree(items->hashes);
+	pfree(items);
 }
 
 /*
- * Calculate the estimate using the algorithm from the paper. Visit all the
- * buckets matching the equality conditions, build the intersection of item
- * lists, etc.
+ * Decompose the range [lo, hi] (inclusive, within the 2^rangeBits dyadic
+ * domain) into dyadic nodes. Each node is a (level, prefix) pair covering
+ * the values [prefix << level, ((prefix + 1) << level) - 1]. The greedy
+ * walk grows each node as long as it stays aligned and does not overshoot
+ * the range, which produces at most 2 * rangeBits nodes (the top level is
+ * rangeBits - 1, the node covering the whole domain is never needed).
  *
- * FIXME add info about function arguments
+ * The arithmetic is done in 64 bits to avoid overflows near the top of
+ * the 32-bit domain.
  */
-static item_list_t *
-omnisketch_column_estimate(omnisketch_t *sketch, int column, int32 hash,
-						   int64 *maxcnt, item_list_t *items)
+static int
+omnisketch_range_decompose(uint64 lo, uint64 hi, int rangeBits,
+						   int *levels, uint32 *prefixes)
 {
-	for (int i = 0; i < sketch->sketchHeight; i++)
+	int			nnodes = 0;
+
+	while (lo <= hi)
 	{
-		bucket_t   *bucket;
-		int32	   *sample;
+		int		level = 0;
 
-		uint32	h = (uint32) SKETCH_HASH(hash, i);
-		int		j = (h % sketch->sketchWidth);
+		while ((level < rangeBits - 1) &&
+			   ((lo & ((((uint64) 1) << (level + 1)) - 1)) == 0) &&
+			   (lo + (((uint64) 1) << (level + 1)) - 1 <= hi))
+			level++;
 
-		bucket = SKETCH_BUCKET(sketch, column, i, j);
-		sample = SKETCH_SAMPLE(sketch, column, i, j);
+		Assert(nnodes < 2 * rangeBits);
 
-		if (bucket->totalCount > *maxcnt)
-			*maxcnt = bucket->totalCount;
+		levels[nnodes] = level;
+		prefixes[nnodes] = (uint32) (lo >> level);
+		nnodes++;
 
-		/*
-		 * First time through, just keep the list, otherwise merge the sample
-		 * into the existing list. This is more efficient than bms_intersect
-		 * (which also has to build the bitmap first).
-		 */
-		if (items == NULL)
-		{
-			items = palloc(offsetof(item_list_t, items) + sizeof(int32) * bucket->sampleCount);
-			items->nitems = bucket->sampleCount;
-			memcpy(items->items, sample, sizeof(int32) * items->nitems);
-		}
-		else
-		{
-			intersect_items(items, bucket->sampleCount, sample);
-		}
+		lo += (((uint64) 1) << level);
 	}
 
-	return items;
+	return nnodes;
 }
 
+/*
+ * Estimate the number of records with the first (range) attribute in the
+ * range [lo, hi], and the remaining attributes matching the record (by
+ * equality). Only meaningful for sketches built by the omnisketch_range
+ * aggregate.
+ *
+ * The range is decomposed into O(log n) dyadic nodes, and the estimates
+ * for the nodes (calculated like regular equality estimates, using the
+ * sub-sketch for the node's level) are summed. The item lists for the
+ * equality attributes are intersected just once and reused for all the
+ * nodes.
+ *
+ * The record may be omitted (or NULL) for sketches built on just the
+ * range attribute.
+ */
 Datum
-omnisketch_estimate(PG_FUNCTION_ARGS)
+omnisketch_estimate_range(PG_FUNCTION_ARGS)
 {
-	omnisketch_t *sketch = NULL;
-	HeapTupleHeader record = PG_GETARG_HEAPTUPLEHEADER(1);
+	omnisketch_t *sketch;
+	int64		lo = PG_GETARG_INT32(1);
+	int64		hi = PG_GETARG_INT32(2);
 
-	Oid			tupType;
-	int32		tupTypmod;
-	TupleDesc	tupdesc;
-	HeapTupleData tuple;
-	int			ncolumns;
-	TypeCacheEntry **my_extra;
-	Datum	   *values;
-	bool	   *nulls;
-	uint32		element_hash;
+	int			rangeBits;
+	int			ncolumns = 0;
+	omnisketch_scratch_t *scratch = NULL;
+	HeapTupleHeader	record = NULL;
 	int64		maxcnt = 0;
 	item_list_t  *items = NULL;
-	double		est;
-
-	/* Build temporary HeapTuple control structure */
-	tuple.t_len = HeapTupleHeaderGetDatumLength(record);
-	ItemPointerSetInvalid(&(tuple.t_self));
-	tuple.t_tableOid = InvalidOid;
-	tuple.t_data = record;
-
-	tupType = HeapTupleHeaderGetTypeId(record);
-	tupTypmod = HeapTupleHeaderGetTypMod(record);
-	tupdesc = lookup_rowtype_tupdesc(tupType, tupTypmod);
-	ncolumns = tupdesc->natts;
+	int			levels[64];
+	uint32		prefixes[64];
+	int			nnodes;
+	double		est = 0;
 
 	/* make sure to have a sketch */
 	if (PG_ARGISNULL(0))
@@ -969,88 +5180,98 @@ omnisketch_estimate(PG_FUNCTION_ARGS)
 
 	AssertCheckSketch(sketch);
 
-	if (sketch->numSketches != ncolumns)
-		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
-			 ncolumns, sketch->numSketches);
+	rangeBits = SKETCH_RANGE_BITS(sketch);
+
+	if (rangeBits == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sketch was not built with dyadic levels"),
+				 errhint("Build the sketch using the omnisketch_range aggregate.")));
 
-	/* cache type info */
-	my_extra = (TypeCacheEntry **) fcinfo->flinfo->fn_extra;
-	if (my_extra == NULL)
+	/* equality conditions on the remaining attributes (may be missing) */
+	if ((PG_NARGS() > 3) && !PG_ARGISNULL(3))
 	{
-		my_extra =
-			MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
-								   sizeof(TypeCacheEntry *) * ncolumns);
-		fcinfo->flinfo->fn_extra = my_extra;
+		record = PG_GETARG_HEAPTUPLEHEADER(3);
+
+		scratch = omnisketch_scratch_init(fcinfo, record);
+		ncolumns = scratch->ncolumns;
 	}
 
-	/* Break down the tuple into fields */
-	values = (Datum *) palloc(ncolumns * sizeof(Datum));
-	nulls = (bool *) palloc(ncolumns * sizeof(bool));
-	heap_deform_tuple(&tuple, tupdesc, values, nulls);
+	if (sketch->numSketches != rangeBits + ncolumns)
+		elog(ERROR, "number of record attributes mismatches sketch (%d != %d)",
+			 ncolumns, (sketch->numSketches - rangeBits));
 
-	for (int i = 0; i < ncolumns; i++)
+	if (scratch != NULL)
 	{
-		Form_pg_attribute att;
-		TypeCacheEntry *typentry;
+		/* Break down the tuple into fields */
+		omnisketch_scratch_deform(scratch, record);
 
-		att = TupleDescAttr(tupdesc, i);
+		for (int i = 0; i < ncolumns; i++)
+		{
+			uint32		element_hash;
 
-		if (att->attisdropped)
-			continue;
+			/* dropped column */
+			if (scratch->hashfcinfo[i] == NULL)
+				continue;
 
-		/*
-		 * Lookup the hash function if not done already
-		 */
-		typentry = my_extra[i];
-		if (typentry == NULL ||
-			typentry->type_id != att->atttypid)
-		{
-			typentry = lookup_type_cache(att->atttypid,
-										 TYPECACHE_HASH_EXTENDED_PROC_FINFO);
-			if (!OidIsValid(typentry->hash_extended_proc_finfo.fn_oid))
-				ereport(ERROR,
-						(errcode(ERRCODE_UNDEFINED_FUNCTION),
-						 errmsg("could not identify an extended hash function for type %s",
-								format_type_be(typentry->type_id))));
-			my_extra[i] = typentry;
-		}
+			/* a NULL is a wildcard - no constraint on this attribute */
+			if (scratch->nulls[i])
+				continue;
 
-		/* Compute hash of element */
-		if (nulls[i])
-		{
-			/* XXX Is it good enough to use 0 for NULL? */
-			element_hash = 0;
-		}
-		else
-		{
-			LOCAL_FCINFO(locfcinfo, 2);
-
-			InitFunctionCallInfoData(*locfcinfo, &typentry->hash_extended_proc_finfo, 2,
-									 att->attcollation, NULL, NULL);
-			locfcinfo->args[0].value = values[i];
-			locfcinfo->args[0].isnull = false;
-			locfcinfo->args[1].value = Int64GetDatum(0);
-			locfcinfo->args[0].isnull = false;
-			element_hash = DatumGetUInt64(FunctionCallInvoke(locfcinfo));
-
-			/* We don't expect hash support functions to return null */
-			Assert(!locfcinfo->isnull);
+			element_hash = omnisketch_scratch_hash(scratch, i);
+
+			items = omnisketch_column_estimate(sketch, rangeBits + i,
+											   element_hash, &maxcnt, items);
+
+			/*
+			 * The estimate is already 0 - skip the remaining columns (and
+			 * their hash function calls).
+			 */
+			if (items->nitems == 0)
+				break;
 		}
+	}
 
-		items = omnisketch_column_estimate(sketch, i, element_hash, &maxcnt, items);
+	/* clamp the range to the dyadic domain of the sketch */
+	lo = Max(lo, 0);
+	hi = Min(hi, (rangeBits < 32) ? (((int64) 1 << rangeBits) - 1) : PG_INT32_MAX);
+
+	if (lo > hi)
+	{
+		if (items != NULL)
+			omnisketch_free_items(items);
+
+		PG_RETURN_INT64(0);
 	}
 
-	pfree(values);
-	pfree(nulls);
+	/* the equality attributes already zeroed out - no node can match */
+	if ((items != NULL) && (items->nitems == 0))
+	{
+		omnisketch_free_items(items);
 
-	ReleaseTupleDesc(tupdesc);
+		PG_RETURN_INT64(0);
+	}
 
-	/* Avoid leaking memory when handed toasted input. */
-	// PG_FREE_IF_COPY(record, 0);
+	nnodes = omnisketch_range_decompose(lo, hi, rangeBits, levels, prefixes);
 
-	est = maxcnt / sketch->sampleSize * items->nitems;
+	for (int n = 0; n < nnodes; n++)
+	{
+		uint32		prefix = prefixes[n];
+		uint32		h = SKETCH_HASH(prefix, levels[n]);
+		int64		node_maxcnt = maxcnt;
+		item_list_t *node_items;
 
-	pfree(items);
+		node_items = (items != NULL) ? omnisketch_copy_items(items) : NULL;
+		node_items = omnisketch_column_estimate(sketch, levels[n], h,
+												&node_maxcnt, node_items);
+
+		est += node_maxcnt / sketch->sampleSize * node_items->nitems;
+
+		omnisketch_free_items(node_items);
+	}
+
+	if (items != NULL)
+		omnisketch_free_items(items);
 
 	PG_RETURN_INT64(est);
 }
@@ -1068,9 +5289,9 @@ omnisketch_text(PG_FUNCTION_ARGS)
 
 	initStringInfo(&str);
 
-	appendStringInfo(&str, "sketches: %d width: %d height: %d sample: %d item: %d count: %d\n",
+	appendStringInfo(&str, "sketches: %d width: %d height: %d sample: %d item: %d count: " INT64_FORMAT "\n",
 				sketch->numSketches, sketch->sketchWidth, sketch->sketchHeight,
-				sketch->sampleSize, sketch->itemSize, sketch->count);
+				sketch->sampleSize, sketch->itemSize, sketch_get_count(sketch));
 
 	/* dump the buckets */
 	for (int i = 0; i < sketch->numSketches; i++)
@@ -1088,11 +5309,15 @@ omnisketch_text(PG_FUNCTION_ARGS)
 			appendStringInfoString(&str, "{");
 			for (int k = 0; k < sketch->sketchWidth; k++)
 			{
-				bucket_t *bucket = SKETCH_BUCKET(sketch, i, j, k);
+				bucket_t	bucket;
+
+				sketch_bucket_load(sketch, SKETCH_BUCKET_INDEX(sketch, i, j, k),
+								   &bucket);
+
 				if (k > 0)
 					appendStringInfo(&str, ", ");
-				appendStringInfo(&str, "(%d, %d) => (%d, %d)\n", j, k,
-								 bucket->totalCount, bucket->sampleCount);
+				appendStringInfo(&str, "(%d, %d) => (" INT64_FORMAT ", %d)\n", j, k,
+								 (int64) bucket.totalCount, bucket.sampleCount);
 			}
 			appendStringInfoString(&str, "}");
 		}
@@ -1116,17 +5341,21 @@ omnisketch_text(PG_FUNCTION_ARGS)
 			appendStringInfoString(&str, "{");
 			for (int k = 0; k < sketch->sketchWidth; k++)
 			{
-				bucket_t *bucket = SKETCH_BUCKET(sketch, i, j, k);
-				int *sample = SKETCH_SAMPLE(sketch, i, j, k);
+				bucket_t	bucket;
+				void *sample = SKETCH_SAMPLE(sketch, i, j, k);
 
-				AssertCheckBucket(sketch, bucket, sample);
+				sketch_bucket_load(sketch, SKETCH_BUCKET_INDEX(sketch, i, j, k),
+								   &bucket);
+
+				AssertCheckBucket(sketch, &bucket, sample,
+								  SKETCH_SAMPLE_HASHES(sketch, i, j, k));
 
 				appendStringInfo(&str, "(%d, %d) => [", j, k);
-				for (int l = 0; l < bucket->sampleCount; l++)
+				for (int l = 0; l < bucket.sampleCount; l++)
 				{
 					if (l > 0)
 						appendStringInfo(&str, ", ");
-					appendStringInfo(&str, "%d", sample[l]);
+					appendStringInfo(&str, "%d", sketch_sample_get(sketch, sample, l));
 				}
 				appendStringInfo(&str, "]\n");
 			}
@@ -1152,9 +5381,9 @@ omnisketch_json(PG_FUNCTION_ARGS)
 
 	initStringInfo(&str);
 
-	appendStringInfo(&str, "{\"sketches\": %d, \"width\": %d, \"height\": %d, \"sample\": %d, \"item\": %d, \"count\": %d, \"sketches\": [",
+	appendStringInfo(&str, "{\"sketches\": %d, \"width\": %d, \"height\": %d, \"sample\": %d, \"item\": %d, \"count\": " INT64_FORMAT ", \"sketches\": [",
 				sketch->numSketches, sketch->sketchWidth, sketch->sketchHeight,
-				sketch->sampleSize, sketch->itemSize, sketch->count);
+				sketch->sampleSize, sketch->itemSize, sketch_get_count(sketch));
 
 	/* dump the buckets, with samples */
 	for (int i = 0; i < sketch->numSketches; i++)
@@ -1171,23 +5400,27 @@ omnisketch_json(PG_FUNCTION_ARGS)
 
 			for (int k = 0; k < sketch->sketchWidth; k++)
 			{
-				bucket_t *bucket = SKETCH_BUCKET(sketch, i, j, k);
-				int *sample = SKETCH_SAMPLE(sketch, i, j, k);
+				bucket_t	bucket;
+				void *sample = SKETCH_SAMPLE(sketch, i, j, k);
+
+				sketch_bucket_load(sketch, SKETCH_BUCKET_INDEX(sketch, i, j, k),
+								   &bucket);
 
-				AssertCheckBucket(sketch, bucket, sample);
+				AssertCheckBucket(sketch, &bucket, sample,
+								  SKETCH_SAMPLE_HASHES(sketch, i, j, k));
 
 				if (k > 0)
 					appendStringInfo(&str, ", ");
 
 				appendStringInfo(&str,
-								 "{\"i\": %d, \"j\": %d, \"total\": %d, \"sample\": %d, \"items\": [",
-								 j, k, bucket->totalCount, bucket->sampleCount);
+								 "{\"i\": %d, \"j\": %d, \"total\": " INT64_FORMAT ", \"sample\": %d, \"items\": [",
+								 j, k, (int64) bucket.totalCount, bucket.sampleCount);
 
-				for (int l = 0; l < bucket->sampleCount; l++)
+				for (int l = 0; l < bucket.sampleCount; l++)
 				{
 					if (l > 0)
 						appendStringInfo(&str, ", ");
-					appendStringInfo(&str, "%d", sample[l]);
+					appendStringInfo(&str, "%d", sketch_sample_get(sketch, sample, l));
 				}
 
 				appendStringInfoString(&str, "]}");
@@ -1201,3 +5434,197 @@ omnisketch_json(PG_FUNCTION_ARGS)
 
 	PG_RETURN_TEXT_P(cstring_to_text(str.data));
 }
+
+/*
+ * Per-attribute-sketch summary statistics, mostly for judging how well the
+ * sketch is provisioned for the data set. Returns one row per sub-sketch
+ * (for range sketches that includes each dyadic level), with the fraction
+ * of non-empty buckets, the average sample fill factor, the fraction of
+ * buckets with a saturated sample (sampleCount == sampleSize, i.e. buckets
+ * that started replacing items), and min/max/avg of the bucket counters.
+ *
+ * A sketch with mostly empty buckets and no saturation is over-provisioned
+ * (a larger epsilon/delta or a memory budget would do), while saturation
+ * close to 1.0 means the estimates lean heavily on the sample bound.
+ */
+Datum
+omnisketch_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext	oldcontext;
+		TupleDesc		tupdesc;
+		omnisketch_t   *sketch;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* keep a copy of the sketch for the subsequent calls */
+		sketch = PG_GETARG_OMNISKETCH(0);
+
+		AssertCheckSketch(sketch);
+
+		funcctx->user_fctx = omnisketch_copy(sketch);
+		funcctx->max_calls = sketch->numSketches;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		omnisketch_t   *sketch = (omnisketch_t *) funcctx->user_fctx;
+		int				a = funcctx->call_cntr;
+		int				nbuckets = SKETCH_SIZE(sketch);
+
+		int64			nonempty = 0;
+		int64			saturated = 0;
+		int64			sample_total = 0;
+		int64			count_min = PG_INT64_MAX;
+		int64			count_max = 0;
+		int64			count_total = 0;
+
+		Datum			values[8];
+		bool			nulls[8];
+		HeapTuple		tuple;
+
+		for (int i = 0; i < sketch->sketchHeight; i++)
+		{
+			for (int j = 0; j < sketch->sketchWidth; j++)
+			{
+				bucket_t	bucket;
+
+				sketch_bucket_load(sketch, SKETCH_BUCKET_INDEX(sketch, a, i, j),
+								   &bucket);
+
+				if (bucket.sampleCount > 0)
+					nonempty++;
+
+				if (bucket.sampleCount == sketch->sampleSize)
+					saturated++;
+
+				sample_total += bucket.sampleCount;
+
+				count_min = Min(count_min, (int64) bucket.totalCount);
+				count_max = Max(count_max, (int64) bucket.totalCount);
+				count_total += (int64) bucket.totalCount;
+			}
+		}
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(a);
+		values[1] = Int32GetDatum(nbuckets);
+		values[2] = Float8GetDatum((double) nonempty / nbuckets);
+		values[3] = Float8GetDatum((double) sample_total /
+								   ((int64) nbuckets * sketch->sampleSize));
+		values[4] = Float8GetDatum((double) saturated / nbuckets);
+		values[5] = Int64GetDatum(count_min);
+		values[6] = Int64GetDatum(count_max);
+		values[7] = Float8GetDatum((double) count_total / nbuckets);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Structured dump of the sketch contents - one row per bucket, with the
+ * sample items as a native int[] array. This exposes the same data as the
+ * omnisketch_json dump (the i/j/total/sample/items columns match the json
+ * keys), but streams it as plain Datums instead of formatting one huge
+ * text value, so the contents can be loaded into a table and queried
+ * without any string parsing.
+ */
+Datum
+omnisketch_buckets(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext	oldcontext;
+		TupleDesc		tupdesc;
+		omnisketch_t   *sketch;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* keep a copy of the sketch for the subsequent calls */
+		sketch = PG_GETARG_OMNISKETCH(0);
+
+		AssertCheckSketch(sketch);
+
+		funcctx->user_fctx = omnisketch_copy(sketch);
+		funcctx->max_calls = (uint64) sketch->numSketches * SKETCH_SIZE(sketch);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		omnisketch_t   *sketch = (omnisketch_t *) funcctx->user_fctx;
+		int				a = funcctx->call_cntr / SKETCH_SIZE(sketch);
+		int				idx = funcctx->call_cntr % SKETCH_SIZE(sketch);
+		int				i = idx / sketch->sketchWidth;
+		int				j = idx % sketch->sketchWidth;
+
+		bucket_t		bucket;
+		void		   *sample = SKETCH_SAMPLE(sketch, a, i, j);
+		Datum		   *items;
+		ArrayType	   *arr;
+
+		Datum			values[6];
+		bool			nulls[6];
+		HeapTuple		tuple;
+
+		sketch_bucket_load(sketch, SKETCH_BUCKET_INDEX(sketch, a, i, j),
+						   &bucket);
+
+		AssertCheckBucket(sketch, &bucket, sample,
+						  SKETCH_SAMPLE_HASHES(sketch, a, i, j));
+
+		items = (Datum *) palloc(bucket.sampleCount * sizeof(Datum));
+
+		for (int k = 0; k < bucket.sampleCount; k++)
+			items[k] = Int32GetDatum(sketch_sample_get(sketch, sample, k));
+
+		arr = construct_array(items, bucket.sampleCount, INT4OID,
+							  sizeof(int32), true, TYPALIGN_INT);
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(a);
+		values[1] = Int32GetDatum(i);
+		values[2] = Int32GetDatum(j);
+		values[3] = Int64GetDatum((int64) bucket.totalCount);
+		values[4] = Int32GetDatum(bucket.sampleCount);
+		values[5] = PointerGetDatum(arr);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
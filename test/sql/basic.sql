@@ -4,6 +4,7 @@
 SET client_min_messages = 'WARNING';
 \i omnisketch--1.0.0.sql
 \i omnisketch--1.0.0--1.0.1.sql
+\i omnisketch--1.0.1--1.0.2.sql
 SET client_min_messages = 'NOTICE';
 
 \set ECHO all
@@ -25,11 +26,168 @@ SELECT mod(id,10), omnisketch(0.01, 0.01, (a, b)) AS s
 
 SELECT omnisketch_count(omnisketch(t.s)) FROM t;
 
+-- rolling up many sketches (exercises the batched k-way merge)
+SELECT omnisketch_count(omnisketch(x.s))
+  FROM (SELECT omnisketch(0.01, 0.01, (a, b)) AS s FROM d GROUP BY mod(id, 100)) x;
+
 SELECT omnisketch_estimate(omnisketch(t.s), (1, 2, 3)) FROM t;
 
 SELECT (SELECT omnisketch_estimate(omnisketch(t.s), (i, i)) FROM t) BETWEEN 500 AND 1500 AS e FROM generate_series(1,10) s(i);
 
 SELECT (SELECT omnisketch_estimate(omnisketch(t.s), (i, i+1)) FROM t) < 500 AS e FROM generate_series(1,10) s(i);
 
+-- NULL in the predicate is a wildcard (no constraint on the attribute)
+SELECT (SELECT omnisketch_estimate(omnisketch(t.s), (i, NULL::int)) FROM t) BETWEEN 500 AND 1500 AS e FROM generate_series(1,10) s(i);
+
+SELECT omnisketch_estimate(omnisketch(t.s), (NULL::int, NULL::int)) FROM t;
+
+-- estimates on a sketch stored out of line, uncompressed (sliced access)
+CREATE TABLE t2 (s omnisketch);
+ALTER TABLE t2 ALTER COLUMN s SET STORAGE EXTERNAL;
+
+INSERT INTO t2 SELECT omnisketch(0.01, 0.01, (a, b)) FROM d;
+
+SELECT (SELECT omnisketch_estimate(t2.s, (i, i)) FROM t2) BETWEEN 500 AND 1500 AS e FROM generate_series(1,10) s(i);
+
+DROP TABLE t2;
+
+DROP TABLE t;
+DROP TABLE d;
+
+-- pack/unpack roundtrip preserves the sketch contents
+CREATE TABLE d (id int, a int, b int);
+
+INSERT INTO d
+SELECT i, mod(i,100), mod(i,100)
+  FROM generate_series(1,10000) s(i);
+
+SELECT pg_column_size(omnisketch_pack(s)) < pg_column_size(s) AS smaller,
+       omnisketch_unpack(omnisketch_pack(s))::text = s::text AS roundtrip
+  FROM (SELECT omnisketch(0.05, 0.05, (a, b)) AS s FROM d) x;
+
+DROP TABLE d;
+
+-- sizing the sketch for an explicit memory budget
+CREATE TABLE d (id int, a int, b int);
+
+INSERT INTO d
+SELECT i, mod(i,100), mod(i,100)
+  FROM generate_series(1,10000) s(i);
+
+SELECT pg_column_size(s) <= 65536 AS within_budget,
+       omnisketch_count(s) AS cnt
+  FROM (SELECT omnisketch(0.01, 0.01, 65536, (a, b)) AS s FROM d) x;
+
+DROP TABLE d;
+
+-- summary statistics (one row per attribute)
+CREATE TABLE d (id int, a int, b int);
+
+INSERT INTO d
+SELECT i, mod(i,100), mod(i,100)
+  FROM generate_series(1,10000) s(i);
+
+SELECT sketch, buckets > 0 AS has_buckets,
+       nonempty BETWEEN 0.0 AND 1.0 AS n,
+       fill_factor BETWEEN 0.0 AND 1.0 AS f,
+       saturated BETWEEN 0.0 AND 1.0 AS sat,
+       min_count <= max_count AS c
+  FROM (SELECT omnisketch(0.05, 0.05, (a, b)) AS s FROM d) x,
+       LATERAL omnisketch_stats(x.s);
+
+DROP TABLE d;
+-- structured bucket dump (one row per bucket, sample items as int[])
+CREATE TABLE d (id int, a int, b int);
+
+INSERT INTO d
+SELECT i, mod(i,100), mod(i,100)
+  FROM generate_series(1,10000) s(i);
+
+-- every record lands in one bucket of each row, so the rows sum to the count
+SELECT bool_and(row_total = 10000) AS totals_ok
+  FROM (SELECT b.sketch, b.i, sum(b.total) AS row_total
+          FROM (SELECT omnisketch(0.05, 0.05, (a, b)) AS s FROM d) x,
+               LATERAL omnisketch_buckets(x.s) b
+         GROUP BY b.sketch, b.i) y;
+
+SELECT bool_and(coalesce(array_length(b.items, 1), 0) = b.sample) AS items_ok
+  FROM (SELECT omnisketch(0.05, 0.05, (a, b)) AS s FROM d) x,
+       LATERAL omnisketch_buckets(x.s) b;
+
+DROP TABLE d;
+-- folding individual late records into a stored sketch
+CREATE TABLE d (id int, a int, b int);
+
+INSERT INTO d
+SELECT i, mod(i,100), mod(i,100)
+  FROM generate_series(1,10000) s(i);
+
+CREATE TABLE t AS SELECT omnisketch(0.05, 0.05, (a, b)) AS s FROM d;
+
+UPDATE t SET s = omnisketch_add_record(s, row(1, 1));
+
+SELECT omnisketch_count(t.s) FROM t;
+
+-- the late record is counted towards the estimate of its group
+SELECT (SELECT omnisketch_estimate(t.s, (1, 1)) FROM t) BETWEEN 50 AND 150 AS e;
+
+DROP TABLE t;
+DROP TABLE d;
+-- 64-bit counter sketches (same estimates, can't mix with regular ones)
+CREATE TABLE d (id int, a int, b int);
+
+INSERT INTO d
+SELECT i, mod(i,100), mod(i,100)
+  FROM generate_series(1,10000) s(i);
+
+SELECT omnisketch_count(omnisketch_wide(0.05, 0.05, (a, b))) FROM d;
+
+SELECT (SELECT omnisketch_estimate(x.s, (1, 1))
+          FROM (SELECT omnisketch_wide(0.05, 0.05, (a, b)) AS s FROM d) x) BETWEEN 50 AND 150 AS e;
+
+SELECT omnisketch_unpack(omnisketch_pack(s))::text = s::text AS roundtrip
+  FROM (SELECT omnisketch_wide(0.05, 0.05, (a, b)) AS s FROM d) x;
+
+SELECT omnisketch(x.s)
+  FROM (SELECT omnisketch_wide(0.05, 0.05, (a, b)) AS s FROM d
+        UNION ALL
+        SELECT omnisketch(0.05, 0.05, (a, b)) FROM d) x;
+
+DROP TABLE d;
+-- sliding-window sketches (ring of per-epoch sub-sketches)
+CREATE TABLE d (id int, a int, b int);
+
+INSERT INTO d
+SELECT i, mod(i,100), mod(i,100)
+  FROM generate_series(1,100000) s(i);
+
+-- epoch labels 0-9 with a window of 4, so only epochs 6-9 stay live
+CREATE TABLE t AS
+SELECT omnisketch_window(0.01, 0.01, 4, mod(id,10), (a, b)) AS s FROM d;
+
+SELECT omnisketch_count(t.s) FROM t;
+
+-- value 7 only occurs in the (live) epoch 7, value 5 is fully expired
+SELECT (SELECT omnisketch_estimate(t.s, (7, 7)) FROM t) BETWEEN 500 AND 1500 AS live;
+
+SELECT (SELECT omnisketch_estimate(t.s, (5, 5)) FROM t) < 500 AS expired;
+
+-- wildcards only see the live records too
+SELECT omnisketch_estimate(t.s, (NULL::int, NULL::int)) FROM t;
+
+-- advancing retires the expired epochs in place
+SELECT omnisketch_count(omnisketch_advance(t.s, 12)) AS last_epoch,
+       omnisketch_count(omnisketch_advance(t.s, 13)) AS empty
+  FROM t;
+
+-- pack/unpack keeps the window descriptor
+SELECT omnisketch_unpack(omnisketch_pack(t.s))::text = t.s::text AS roundtrip FROM t;
+
+-- merging partial windowed sketches aligns their epochs first (the group
+-- with only the old labels is fully expired by the merge)
+SELECT omnisketch_count(omnisketch(x.s))
+  FROM (SELECT omnisketch_window(0.01, 0.01, 4, mod(id,10), (a, b)) AS s
+          FROM d GROUP BY (mod(id,10) < 5)) x;
+
 DROP TABLE t;
 DROP TABLE d;
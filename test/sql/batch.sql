@@ -0,0 +1,42 @@
+\set ECHO none
+
+-- disable the notices for the create script (shell types etc.)
+SET client_min_messages = 'WARNING';
+\i omnisketch--1.0.0.sql
+\i omnisketch--1.0.0--1.0.1.sql
+\i omnisketch--1.0.1--1.0.2.sql
+SET client_min_messages = 'NOTICE';
+
+\set ECHO all
+
+SET max_parallel_workers_per_gather = 0;
+SET max_parallel_maintenance_workers = 0;
+
+CREATE TABLE d (id int, a int, b int);
+
+INSERT INTO d
+SELECT i, mod(i,100), mod(i,100)
+  FROM generate_series(1,100000) s(i);
+
+ANALYZE d;
+
+-- build the sketches from batches of rows, not row by row
+CREATE TABLE t AS
+SELECT p, omnisketch(0.01, 0.01, batch) AS s
+  FROM (SELECT mod(id,10) AS p, array_agg((a, b)) AS batch
+          FROM d GROUP BY mod(id,10)) batches
+ GROUP BY p;
+
+SELECT omnisketch_count(omnisketch(t.s)) FROM t;
+
+SELECT (SELECT omnisketch_estimate(omnisketch(t.s), (i, i)) FROM t) BETWEEN 500 AND 1500 AS e FROM generate_series(1,10) s(i);
+
+SELECT (SELECT omnisketch_estimate(omnisketch(t.s), (i, i+1)) FROM t) < 500 AS e FROM generate_series(1,10) s(i);
+
+-- batched estimates match the row-by-row estimates
+SELECT (SELECT omnisketch_estimate_batch(omnisketch(t.s), b.batch) FROM t) =
+       (SELECT array_agg((SELECT omnisketch_estimate(omnisketch(t.s), (i, i)) FROM t)) FROM generate_series(1,10) s(i)) AS batch_matches
+  FROM (SELECT array_agg((i, i)) AS batch FROM generate_series(1,10) s(i)) b;
+
+DROP TABLE t;
+DROP TABLE d;
@@ -0,0 +1,42 @@
+\set ECHO none
+
+-- disable the notices for the create script (shell types etc.)
+SET client_min_messages = 'WARNING';
+\i omnisketch--1.0.0.sql
+\i omnisketch--1.0.0--1.0.1.sql
+\i omnisketch--1.0.1--1.0.2.sql
+SET client_min_messages = 'NOTICE';
+
+\set ECHO all
+
+SET max_parallel_workers_per_gather = 0;
+SET max_parallel_maintenance_workers = 0;
+
+CREATE TABLE d (id int, ts int, a int);
+
+INSERT INTO d
+SELECT i, mod(i,1024), mod(i,100)
+  FROM generate_series(1,100000) s(i);
+
+ANALYZE d;
+
+CREATE TABLE t AS
+SELECT mod(id,10), omnisketch_range(0.01, 0.01, 10, (ts, a)) AS s
+  FROM d GROUP BY mod(id,10);
+
+SELECT omnisketch_count(omnisketch(t.s)) FROM t;
+
+-- range attribute value not in the dyadic domain
+SELECT omnisketch_range(0.01, 0.01, 5, (ts, a)) FROM d;
+
+-- the whole domain, i.e. plain equality on the second attribute
+SELECT (SELECT omnisketch_estimate_range(omnisketch(t.s), 0, 1023, row(i)) FROM t) BETWEEN 500 AND 1500 AS e FROM generate_series(1,10) s(i);
+
+-- half of the domain
+SELECT (SELECT omnisketch_estimate_range(omnisketch(t.s), 0, 511, row(i)) FROM t) BETWEEN 100 AND 900 AS e FROM generate_series(1,10) s(i);
+
+-- empty range
+SELECT (SELECT omnisketch_estimate_range(omnisketch(t.s), 512, 100, row(i)) FROM t) AS e FROM generate_series(1,10) s(i);
+
+DROP TABLE t;
+DROP TABLE d;